@@ -0,0 +1,6042 @@
+/*
+ * Prown is a simple tool developed to give users the possibility to
+ * own projects (files and repositories).
+ * Copyright (C) 2021 EDF SA.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string.h>
+#include <bsd/string.h>
+#include <limits.h>
+#include <math.h>
+#include <ctype.h>
+#include <endian.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <error.h>
+#include <grp.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <libintl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/openat2.h>
+
+#include "libprown.h"
+#include "prown.h"
+
+/* variable for verbose mode */
+int verbose;
+
+/* do not print error messages, with the library only */
+int quiet;
+
+/* variable to activate or not recursion */
+int recurse = 1;
+
+/* maximum depth of walked entries under given paths, -1 if unlimited */
+int max_depth = -1;
+
+/* do not cross filesystems boundaries in recursive walks */
+int one_file_system;
+
+/* number of threads walking directory trees */
+int jobs = 1;
+
+/* budget of directories file descriptors kept open by walks, 0 for default */
+int fd_budget;
+
+/* process directories entries sorted by inode numbers */
+int inode_order;
+
+/* part of project trees processed by this process with --shard */
+struct shard shard = {0, 1, 2};
+
+/* file where progress of walks is saved and interval between saves */
+char *checkpoint_file;
+int checkpoint_interval = 60;
+
+/* uid of the user running prown, new owner of the files */
+uid_t owner;
+
+/* metadata of walked entries, only the fields required by prown */
+struct entry_stat {
+    dev_t dev;
+    ino_t ino;
+    mode_t mode;
+    uid_t uid;
+    nlink_t nlink;
+};
+
+struct counters counters;
+
+/* semaphores of USDT probes, see PROBE() */
+PROBE_SEMAPHORE(walk__start);
+PROBE_SEMAPHORE(walk__done);
+PROBE_SEMAPHORE(dir__start);
+PROBE_SEMAPHORE(dir__done);
+PROBE_SEMAPHORE(chown__start);
+PROBE_SEMAPHORE(chown__done);
+PROBE_SEMAPHORE(chmod__start);
+PROBE_SEMAPHORE(chmod__done);
+PROBE_SEMAPHORE(nss__start);
+PROBE_SEMAPHORE(nss__done);
+PROBE_SEMAPHORE(acl__start);
+PROBE_SEMAPHORE(acl__done);
+PROBE_SEMAPHORE(auth__start);
+PROBE_SEMAPHORE(auth__done);
+
+struct walk_task;
+
+void governor_print(FILE *fp);
+char *walk_path(const struct walk_task *dir, const char *name);
+dev_t walk_task_dev(const struct walk_task *task);
+bool walk_loop(const struct walk_task *dir, const char *name,
+               const struct entry_stat *est);
+bool walk_shard_owns(const struct walk_task *dir, const char *name);
+
+/*
+ * Allocation helpers, exit on failure.
+ */
+void *xmalloc(size_t size) {
+    void *ptr = malloc(size);
+
+    if (ptr == NULL) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/*
+ * Write or read exactly len bytes on file descriptor fd.
+ *
+ * Returns 0 on success, -1 on error or end of file.
+ */
+int write_full(int fd, const void *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (const char *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_full(int fd, void *buf, size_t len) {
+    while (len) {
+        ssize_t n = read(fd, buf, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (char *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**********************************************************
+ *                                                        *
+ *                      Statistics                        *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * When enabled with --stats, the number of operations and their latency are
+ * recorded by class of system calls in log2 histograms of nanoseconds. Each
+ * worker thread records in its own slot to avoid sharing cache lines, slots
+ * are summed when statistics are printed.
+ */
+
+enum stats_op {
+    STATS_STAT,
+    STATS_CHOWN,
+    STATS_CHMOD,
+    STATS_OPENDIR,
+    STATS_READDIR,
+    STATS_ACL,
+    STATS_NSS,
+    STATS_NOPS
+};
+
+static const char *stats_op_names[STATS_NOPS] = {
+    "stat", "chown", "chmod", "opendir", "readdir", "acl", "nss"
+};
+
+#define STATS_BUCKETS 40        /* up to 2^39ns (~9min) */
+
+struct stats_slot {
+    atomic_ullong count[STATS_NOPS];
+    atomic_ullong total_ns[STATS_NOPS];
+    atomic_ullong max_ns[STATS_NOPS];
+    atomic_ullong buckets[STATS_NOPS][STATS_BUCKETS];
+    atomic_ullong directories;
+    atomic_ullong errors;
+    atomic_ullong reopened;     /* directories reopened from an ancestor */
+    atomic_ullong auth_checks;  /* is_user_project_admin() */
+    atomic_ullong group_checks; /* is_user_in_group() */
+} __attribute__((aligned(64)));
+
+/* NULL if statistics are disabled, - for stderr */
+char *stats_file;
+static struct stats_slot stats_slots[MAXJOBS];
+static __thread struct stats_slot *stats_local = &stats_slots[0];
+static struct timespec stats_start_time;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Returns start time of an operation, or 0 if statistics are disabled.
+ */
+static inline unsigned long long stats_begin(void) {
+    return stats_file ? now_ns() : 0;
+}
+
+/*
+ * Record operation of class op started at start.
+ */
+static inline void stats_end(enum stats_op op, unsigned long long start) {
+    struct stats_slot *slot = stats_local;
+    unsigned long long ns, max;
+    int bucket;
+
+    if (!start)
+        return;
+    ns = now_ns() - start;
+    bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= STATS_BUCKETS)
+        bucket = STATS_BUCKETS - 1;
+    atomic_fetch_add_explicit(&slot->count[op], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->total_ns[op], ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->buckets[op][bucket], 1,
+                              memory_order_relaxed);
+    max = atomic_load_explicit(&slot->max_ns[op], memory_order_relaxed);
+    if (ns > max)
+        atomic_store_explicit(&slot->max_ns[op], ns, memory_order_relaxed);
+}
+
+/*
+ * Increment counter of current thread statistics slot.
+ */
+#define STATS_INC(counter) \
+        atomic_fetch_add_explicit(&stats_local->counter, 1, \
+                                  memory_order_relaxed)
+
+static unsigned long long stats_sum(size_t offset) {
+    unsigned long long sum = 0;
+
+    for (int i = 0; i < MAXJOBS; i++)
+        sum += atomic_load_explicit((atomic_ullong *)
+                                    ((char *) &stats_slots[i] + offset),
+                                    memory_order_relaxed);
+    return sum;
+}
+
+#define STATS_SUM(field) stats_sum(offsetof(struct stats_slot, field))
+
+/*
+ * Return the peak resident set size of prown in KiB, or -1 if unknown. It is
+ * read in /proc as the resources usage includes the process before exec().
+ */
+long stats_peak_rss(void) {
+    char line[128];
+    long rss = -1;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/status", "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmHWM: %ld kB", &rss) == 1)
+            break;
+    fclose(fp);
+    return rss;
+}
+
+/*
+ * Print statistics as a JSON document in statistics file.
+ */
+void stats_print(void) {
+    struct timespec now;
+    double elapsed;
+    unsigned long long entries = atomic_load(&counters.entries);
+    FILE *fp = stderr;
+
+    if (strcmp(stats_file, "-") && (fp = fopen(stats_file, "w")) == NULL) {
+        ERROR(_("Failed to open statistics file %s: %s\n"), stats_file,
+              strerror(errno));
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - stats_start_time.tv_sec)
+        + (now.tv_nsec - stats_start_time.tv_nsec) / 1e9;
+
+    fprintf(fp, "{\"elapsed\": %.6f, \"jobs\": %d, ", elapsed, jobs);
+    if (shard.count > 1)
+        fprintf(fp, "\"shard\": {\"index\": %d, \"count\": %d, "
+                "\"depth\": %d}, ", shard.index, shard.count, shard.depth);
+    fprintf(fp, "\"walk\": {\"directories\": %llu, \"entries\": %llu, "
+            "\"chowned\": %zu, \"chmoded\": %zu, \"compliant\": %zu, "
+            "\"errors\": %llu, \"hardlinks\": %zu, \"reopened\": %llu, "
+            "\"unchanged\": %zu, \"pruned\": %zu, "
+            "\"entries_per_second\": %.1f}, ",
+            STATS_SUM(directories), entries, atomic_load(&counters.chowned),
+            atomic_load(&counters.chmoded), atomic_load(&counters.compliant),
+            STATS_SUM(errors), atomic_load(&counters.hardlinks),
+            STATS_SUM(reopened), atomic_load(&counters.unchanged),
+            atomic_load(&counters.pruned), elapsed > 0 ? entries / elapsed : 0.0);
+    fprintf(fp, "\"auth\": {\"project_checks\": %llu, "
+            "\"group_checks\": %llu}, ", STATS_SUM(auth_checks),
+            STATS_SUM(group_checks));
+    fprintf(fp, "\"memory\": {\"peak_rss_kb\": %ld}, ", stats_peak_rss());
+    governor_print(fp);
+    fprintf(fp, "\"ops\": {");
+    for (int op = 0; op < STATS_NOPS; op++) {
+        unsigned long long max = 0;
+        bool first = true;
+
+        for (int i = 0; i < MAXJOBS; i++) {
+            unsigned long long m = atomic_load(&stats_slots[i].max_ns[op]);
+
+            if (m > max)
+                max = m;
+        }
+        fprintf(fp, "%s\"%s\": {\"count\": %llu, \"total_ns\": %llu, "
+                "\"max_ns\": %llu, \"histogram\": [", op ? ", " : "",
+                stats_op_names[op], STATS_SUM(count[op]),
+                STATS_SUM(total_ns[op]), max);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            unsigned long long count = STATS_SUM(buckets[op][b]);
+
+            if (!count)
+                continue;
+            /* bucket b counts latencies lower than 2^b ns */
+            fprintf(fp, "%s{\"lt_ns\": %llu, \"count\": %llu}",
+                    first ? "" : ", ", 1ULL << b, count);
+            first = false;
+        }
+        fprintf(fp, "]}");
+    }
+    fprintf(fp, "}}\n");
+
+    if (fp == stderr)
+        fflush(fp);
+    else
+        fclose(fp);
+}
+
+/*
+ * Thread printing statistics when SIGUSR1 is received. The signal is blocked
+ * in all other threads.
+ */
+static void *stats_signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+
+    while (sigwait(set, &sig) == 0)
+        stats_print();
+    return NULL;
+}
+
+/*
+ * Enable statistics, they are printed when SIGUSR1 is received and on exit.
+ * This must be called before any thread creation.
+ */
+void stats_init(void) {
+    static sigset_t set;
+    pthread_t thread;
+
+    clock_gettime(CLOCK_MONOTONIC, &stats_start_time);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (pthread_create(&thread, NULL, stats_signal_thread, &set) == 0)
+        pthread_detach(thread);
+    atexit(stats_print);
+}
+
+/**********************************************************
+ *                                                        *
+ *                Metadata rate governor                  *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * Metadata operations of walks can be limited to protect shared metadata
+ * servers:
+ *
+ * - With --max-ops, a token bucket caps the rate of operations. It is
+ *   implemented as the virtual time of the next operation shared by all
+ *   threads, which may lag behind current time by GOVERNOR_BURST at most to
+ *   allow short bursts. Threads reserve tokens in batches of GOVERNOR_BATCH
+ *   of operations, so the shared time is not updated on every operation.
+ * - With --target-latency, an AIMD controller adjusts the number of threads
+ *   allowed to process entries concurrently. At the end of every window, the
+ *   limit is halved if the average latency of metadata operations (stat,
+ *   chown and chmod) is above the target, it is increased by one otherwise.
+ *   Threads only take the lock of the governor to wait when the limit is
+ *   reached, and the latencies are accounted in batches.
+ *   Once a single thread is allowed, which is always the case with one job,
+ *   the load is reduced further by pausing before each entry: the pause
+ *   starts at the target latency and is doubled while the latency is above
+ *   the target, it is halved otherwise until it is dropped, before the limit
+ *   is raised again.
+ *
+ * The rate of operations is measured over the same windows and smoothed, it
+ * is reported as the rate the governor has settled on.
+ */
+
+#define GOVERNOR_WINDOW 100000000ULL    /* 100ms */
+#define GOVERNOR_BURST 100000000ULL     /* 100ms of operations */
+#define GOVERNOR_MAX_DELAY 100000000ULL /* 100ms pause per entry */
+#define GOVERNOR_BATCH 1000000ULL       /* 1ms of operations or latencies */
+
+static struct {
+    long max_ops;               /* operations per second, 0 if unlimited */
+    unsigned long long interval;        /* ns between operations */
+    unsigned long long batch;   /* operations reserved at once */
+    unsigned epoch;             /* initializations, to drop thread tokens */
+    atomic_ullong next;         /* virtual time of next operation */
+    unsigned long long target;  /* latency target in ns, 0 if none */
+    int jobs;                   /* threads, the limit is ignored with one */
+    atomic_int limit;           /* threads allowed to process entries */
+    atomic_ullong delay;        /* pause in ns before each entry */
+    atomic_int active;
+    atomic_int waiters;         /* threads waiting for the limit */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_ullong ops;
+    atomic_ullong window_start;
+    unsigned long long window_ops;      /* operations at window start */
+    atomic_ullong latency;      /* sum of operations latencies in window */
+    atomic_ullong samples;
+    double rate;                /* smoothed rate in operations/s */
+} governor = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* latency of the metadata operations of the thread not accounted yet since
+ * governor_latency_start, with AIMD only */
+static __thread unsigned long long governor_latency_ns;
+static __thread unsigned long long governor_latency_samples;
+static __thread unsigned long long governor_latency_start;
+
+/* tokens reserved by the thread, from virtual time governor_token, with
+ * --max-ops only */
+static __thread unsigned long long governor_token;
+static __thread unsigned long long governor_tokens;
+static __thread unsigned governor_token_epoch;
+
+static inline bool governor_enabled(void) {
+    return governor.max_ops || governor.target;
+}
+
+/*
+ * Initialize the governor with at most max_ops operations per second and
+ * target metadata operations latency in ns, 0 to disable each of them.
+ */
+void governor_init(long max_ops, unsigned long long target) {
+    governor.max_ops = max_ops;
+    governor.target = target;
+    if (!governor_enabled())
+        return;
+    if (governor.max_ops) {
+        governor.interval = 1000000000ULL / governor.max_ops;
+        governor.batch = GOVERNOR_BATCH / governor.interval;
+        if (governor.batch == 0)
+            governor.batch = 1;
+    }
+    governor.epoch++;
+    governor.jobs = jobs;
+    atomic_store(&governor.limit, jobs);
+    atomic_store(&governor.window_start, now_ns());
+    /* no burst allowed on start */
+    atomic_store(&governor.next, atomic_load(&governor.window_start));
+}
+
+/*
+ * Close the window started at start if no other thread has done it, update
+ * the measured rate and adjust the concurrency limit.
+ */
+static void governor_window(unsigned long long start, unsigned long long now) {
+    unsigned long long ops, latency, samples, delay;
+    double rate;
+
+    if (!atomic_compare_exchange_strong(&governor.window_start, &start, now))
+        return;
+
+    pthread_mutex_lock(&governor.lock);
+    ops = atomic_load(&governor.ops);
+    rate = (ops - governor.window_ops) * 1e9 / (now - start);
+    governor.rate = governor.rate ? 0.8 * governor.rate + 0.2 * rate : rate;
+    governor.window_ops = ops;
+    if (governor.target) {
+        latency = atomic_exchange(&governor.latency, 0);
+        samples = atomic_exchange(&governor.samples, 0);
+        delay = atomic_load(&governor.delay);
+        if (samples && latency / samples > governor.target) {
+            if (atomic_load(&governor.limit) > 1)
+                atomic_store(&governor.limit,
+                             atomic_load(&governor.limit) / 2);
+            else
+                delay = delay ? delay * 2 : governor.target;
+            if (delay > GOVERNOR_MAX_DELAY)
+                delay = GOVERNOR_MAX_DELAY;
+        } else if (delay) {
+            delay = delay / 2 >= governor.target ? delay / 2 : 0;
+        } else if (atomic_load(&governor.limit) < governor.jobs) {
+            atomic_fetch_add(&governor.limit, 1);
+            pthread_cond_broadcast(&governor.cond);
+        }
+        atomic_store(&governor.delay, delay);
+    }
+    pthread_mutex_unlock(&governor.lock);
+}
+
+/*
+ * Account a metadata operation, waiting for its token with --max-ops.
+ */
+void governor_op(void) {
+    unsigned long long now, next, slot, start;
+    struct timespec ts;
+
+    if (!governor_enabled())
+        return;
+    atomic_fetch_add_explicit(&governor.ops, 1, memory_order_relaxed);
+    now = now_ns();
+    start = atomic_load_explicit(&governor.window_start,
+                                 memory_order_relaxed);
+    if (now - start >= GOVERNOR_WINDOW)
+        governor_window(start, now);
+    if (!governor.max_ops)
+        return;
+
+    /* reserve a batch of tokens when the thread has none left */
+    if (governor_tokens == 0 || governor_token_epoch != governor.epoch) {
+        next = atomic_load(&governor.next);
+        do {
+            slot = now > GOVERNOR_BURST && next < now - GOVERNOR_BURST
+                ? now - GOVERNOR_BURST : next;
+        } while (!atomic_compare_exchange_weak(&governor.next, &next,
+                                               slot + governor.batch
+                                               * governor.interval));
+        governor_token = slot;
+        governor_tokens = governor.batch;
+        governor_token_epoch = governor.epoch;
+    }
+    slot = governor_token;
+    governor_token += governor.interval;
+    governor_tokens--;
+    if (slot > now) {
+        ts.tv_sec = (slot - now) / 1000000000ULL;
+        ts.tv_nsec = (slot - now) % 1000000000ULL;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    }
+}
+
+/*
+ * With AIMD, returns the start time of a metadata operation, 0 otherwise.
+ */
+static inline unsigned long long governor_begin(void) {
+    return governor.target ? now_ns() : 0;
+}
+
+/*
+ * With AIMD, account the latency of a metadata operation started at start,
+ * as returned by governor_begin().
+ */
+static inline void governor_end(unsigned long long start) {
+    if (!start)
+        return;
+    governor_latency_ns += now_ns() - start;
+    governor_latency_samples++;
+}
+
+/*
+ * Count the thread among the active ones if the limit is not reached.
+ *
+ * Returns true if the thread is allowed to process an entry.
+ */
+static bool governor_try_enter(void) {
+    int active = atomic_load(&governor.active);
+
+    do {
+        if (active >= atomic_load(&governor.limit))
+            return false;
+    } while (!atomic_compare_exchange_weak(&governor.active, &active,
+                                           active + 1));
+    return true;
+}
+
+/*
+ * With AIMD, pause if required and wait until the thread is allowed to
+ * process an entry.
+ */
+void governor_enter(void) {
+    unsigned long long delay;
+    struct timespec ts;
+
+    if (!governor.target)
+        return;
+    if ((delay = atomic_load_explicit(&governor.delay,
+                                      memory_order_relaxed))) {
+        ts.tv_sec = delay / 1000000000ULL;
+        ts.tv_nsec = delay % 1000000000ULL;
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    }
+    if (governor.jobs == 1 || governor_try_enter())
+        return;
+    pthread_mutex_lock(&governor.lock);
+    atomic_fetch_add(&governor.waiters, 1);
+    while (!governor_try_enter())
+        pthread_cond_wait(&governor.cond, &governor.lock);
+    atomic_fetch_sub(&governor.waiters, 1);
+    pthread_mutex_unlock(&governor.lock);
+}
+
+/*
+ * With AIMD, record the latency of the metadata operations performed by the
+ * thread once a batch is complete, and let another thread process an entry.
+ */
+void governor_exit(void) {
+    unsigned long long now;
+
+    if (!governor.target)
+        return;
+    now = now_ns();
+    if (governor_latency_ns >= GOVERNOR_BATCH
+        || now - governor_latency_start >= GOVERNOR_BATCH) {
+        atomic_fetch_add(&governor.latency, governor_latency_ns);
+        atomic_fetch_add(&governor.samples, governor_latency_samples);
+        governor_latency_ns = governor_latency_samples = 0;
+        governor_latency_start = now;
+    }
+    if (governor.jobs == 1)
+        return;
+    atomic_fetch_sub(&governor.active, 1);
+    if (atomic_load(&governor.waiters)) {
+        pthread_mutex_lock(&governor.lock);
+        pthread_cond_signal(&governor.cond);
+        pthread_mutex_unlock(&governor.lock);
+    }
+}
+
+/*
+ * Returns the rate of metadata operations the governor has settled on, or
+ * the average rate if the run was shorter than a window.
+ */
+double governor_rate(void) {
+    unsigned long long elapsed;
+    double rate;
+
+    pthread_mutex_lock(&governor.lock);
+    rate = governor.rate;
+    pthread_mutex_unlock(&governor.lock);
+    elapsed = now_ns() - atomic_load(&governor.window_start);
+    if (rate == 0 && elapsed)
+        rate = atomic_load(&governor.ops) * 1e9 / elapsed;
+    return rate;
+}
+
+/*
+ * Report the rate of metadata operations and the concurrency the governor has
+ * settled on, in verbose mode.
+ */
+void governor_report(void) {
+    if (!governor_enabled() || !atomic_load(&governor.ops))
+        return;
+    if (governor.target && atomic_load(&governor.delay)) {
+        VERBOSE(_("Metadata operations rate settled at %.0f operations/s "
+                  "with %d concurrent threads and %.1f ms pauses\n"),
+                governor_rate(), atomic_load(&governor.limit),
+                atomic_load(&governor.delay) / 1e6);
+    } else if (governor.target) {
+        VERBOSE(_("Metadata operations rate settled at %.0f operations/s "
+                  "with %d concurrent threads\n"), governor_rate(),
+                atomic_load(&governor.limit));
+    } else {
+        VERBOSE(_("Metadata operations rate settled at %.0f operations/s\n"),
+                governor_rate());
+    }
+}
+
+/*
+ * Print governor settings and state in statistics JSON object fp.
+ */
+void governor_print(FILE *fp) {
+    int limit;
+
+    if (!governor_enabled())
+        return;
+    limit = atomic_load(&governor.limit);
+    fprintf(fp, "\"governor\": {\"max_ops\": %ld, \"target_latency_ns\": "
+            "%llu, \"ops\": %llu, \"rate\": %.1f, \"concurrency\": %d, "
+            "\"delay_ns\": %llu}, ", governor.max_ops, governor.target,
+            atomic_load(&governor.ops), governor_rate(), limit,
+            atomic_load(&governor.delay));
+}
+
+/**********************************************************
+ *                                                        *
+ *                      Exclusions                        *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * Entries whose names match one of the patterns given with --exclude or
+ * EXCLUDE configuration parameter are not processed, and excluded
+ * directories are not walked. Patterns are matched against the names read in
+ * directories, before any system call on the entries.
+ *
+ * Patterns are compiled when they are added. Literal names (the most common
+ * case, eg. .git) are looked up in a hash table, globs reduced to a prefix or
+ * a suffix (eg. *.tmp) are compared to this literal part and only the other
+ * globs are matched with fnmatch().
+ */
+
+enum exclude_kind {
+    EXCLUDE_PREFIX,             /* literal followed by * */
+    EXCLUDE_SUFFIX,             /* * followed by literal */
+    EXCLUDE_GLOB
+};
+
+struct exclude_glob {
+    enum exclude_kind kind;
+    char *pattern;              /* literal part for prefix and suffix */
+    size_t len;
+};
+
+static struct {
+    char **literals;            /* hash table of literal names */
+    size_t nliterals;
+    size_t size;                /* power of 2 */
+    struct exclude_glob *globs;
+    size_t nglobs;
+} exclude;
+
+/* FNV-1a hash of name */
+static uint64_t exclude_hash(const char *name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*name)
+        hash = (hash ^ (unsigned char) *name++) * 0x100000001b3ULL;
+    return hash;
+}
+
+static void exclude_literal_insert(char *name) {
+    size_t i = exclude_hash(name) & (exclude.size - 1);
+
+    while (exclude.literals[i]) {
+        if (strcmp(exclude.literals[i], name) == 0) {
+            free(name);
+            return;
+        }
+        i = (i + 1) & (exclude.size - 1);
+    }
+    exclude.literals[i] = name;
+    exclude.nliterals++;
+}
+
+/*
+ * Compile pattern and add it to exclusions. Patterns are matched against
+ * entries names, they cannot contain slashes.
+ *
+ * Returns 0 on success, -1 if pattern is invalid.
+ */
+int exclude_add(const char *pattern) {
+    size_t len = strlen(pattern);
+    const char *meta = strpbrk(pattern, "*?[\\");
+    struct exclude_glob *glob;
+    char *dup;
+
+    if (len == 0 || strchr(pattern, '/'))
+        return -1;
+    if ((dup = strdup(pattern)) == NULL) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    if (meta == NULL) {
+        if ((exclude.nliterals + 1) * 2 > exclude.size) {
+            char **old = exclude.literals;
+            size_t oldsize = exclude.size;
+
+            exclude.size = exclude.size ? exclude.size * 2 : 16;
+            exclude.literals = xmalloc(exclude.size * sizeof(char *));
+            memset(exclude.literals, 0, exclude.size * sizeof(char *));
+            exclude.nliterals = 0;
+            for (size_t i = 0; i < oldsize; i++)
+                if (old[i])
+                    exclude_literal_insert(old[i]);
+            free(old);
+        }
+        exclude_literal_insert(dup);
+        return 0;
+    }
+
+    exclude.globs = xrealloc(exclude.globs, (exclude.nglobs + 1)
+                             * sizeof(struct exclude_glob));
+    glob = &exclude.globs[exclude.nglobs++];
+    glob->kind = EXCLUDE_GLOB;
+    glob->pattern = dup;
+    glob->len = len;
+    if (meta == pattern + len - 1 && *meta == '*') {
+        glob->kind = EXCLUDE_PREFIX;
+        glob->len = len - 1;
+        dup[len - 1] = '\0';
+    } else if (meta == pattern && *meta == '*'
+               && strpbrk(pattern + 1, "*?[\\") == NULL) {
+        glob->kind = EXCLUDE_SUFFIX;
+        glob->len = len - 1;
+        memmove(dup, dup + 1, len);
+    }
+    return 0;
+}
+
+/*
+ * Returns true if entry name matches one of the exclusion patterns.
+ */
+bool exclude_match(const char *name) {
+    size_t len;
+
+    if (exclude.nliterals) {
+        for (size_t i = exclude_hash(name) & (exclude.size - 1);
+             exclude.literals[i]; i = (i + 1) & (exclude.size - 1))
+            if (strcmp(exclude.literals[i], name) == 0)
+                return true;
+    }
+    if (exclude.nglobs == 0)
+        return false;
+    len = strlen(name);
+    for (size_t i = 0; i < exclude.nglobs; i++) {
+        const struct exclude_glob *glob = &exclude.globs[i];
+
+        switch (glob->kind) {
+        case EXCLUDE_PREFIX:
+            if (strncmp(name, glob->pattern, glob->len) == 0)
+                return true;
+            break;
+        case EXCLUDE_SUFFIX:
+            if (len >= glob->len
+                && memcmp(name + len - glob->len, glob->pattern,
+                          glob->len) == 0)
+                return true;
+            break;
+        case EXCLUDE_GLOB:
+            if (fnmatch(glob->pattern, name, 0) == 0)
+                return true;
+            break;
+        }
+    }
+    return false;
+}
+
+/**********************************************************
+ *                                                        *
+ *                  Configuration load                    *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * Node of the project parents index. The index is a tree of paths components
+ * starting from /, children are sorted by name for binary search.
+ */
+struct parent_node {
+    char *name;
+    bool is_parent;             /* a project parent ends at this node */
+    struct parent_node *children;
+    int nchildren;
+};
+
+/*
+ * Configuration, loaded once and immutable afterwards.
+ */
+static struct {
+    struct parent_node parents; /* project parents index root (/) */
+    int nparents;
+    char **authorized_groups;   /* names of authorized groups */
+    gid_t *authorized_gids;     /* and their resolved gids */
+    bool *authorized_exists;    /* false if authorized group does not exist */
+    int nauthorized;
+    bool loaded;
+} config;
+
+static int cmp_parent_node(const void *a, const void *b) {
+    return strcmp(((const struct parent_node *) a)->name,
+                  ((const struct parent_node *) b)->name);
+}
+
+/*
+ * Returns child of node with the given name, or NULL if not found.
+ */
+static struct parent_node *parent_node_child(struct parent_node *node,
+                                             const char *name) {
+    struct parent_node key = {.name = (char *) name };
+
+    if (node->nchildren == 0)
+        return NULL;
+    return bsearch(&key, node->children, node->nchildren,
+                   sizeof(struct parent_node), cmp_parent_node);
+}
+
+/*
+ * Add project parent path in index. Empty components (ie. double or trailing
+ * slashes) are ignored.
+ */
+void add_project_parent(const char *path) {
+    struct parent_node *node = &config.parents;
+    char *dup = strdup(path), *saveptr, *name;
+
+    if (dup == NULL) {
+        ERROR(_("Unable to allocate memory for loading "
+                "configuration file parameters\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    for (name = strtok_r(dup, "/", &saveptr); name;
+         name = strtok_r(NULL, "/", &saveptr)) {
+        struct parent_node *child = parent_node_child(node, name);
+        int pos = 0;
+
+        if (child) {
+            node = child;
+            continue;
+        }
+        /* insert new child at its sorted position */
+        while (pos < node->nchildren
+               && strcmp(node->children[pos].name, name) < 0)
+            pos++;
+        node->children = xrealloc(node->children,
+                                  (node->nchildren + 1) *
+                                  sizeof(struct parent_node));
+        memmove(&node->children[pos + 1], &node->children[pos],
+                (node->nchildren - pos) * sizeof(struct parent_node));
+        node->nchildren++;
+        child = &node->children[pos];
+        memset(child, 0, sizeof(struct parent_node));
+        child->name = strdup(name);
+        if (child->name == NULL) {
+            ERROR(_("Unable to allocate memory for loading "
+                    "configuration file parameters\n"));
+            exit(EXIT_FAILURE);
+        }
+        node = child;
+    }
+    if (!node->is_parent) {
+        node->is_parent = true;
+        config.nparents++;
+    }
+    free(dup);
+}
+
+/*
+ * Add authorized group and resolve its gid.
+ */
+void add_authorized_group(const char *name) {
+    unsigned long long start;
+    struct group *gr;
+    int n = config.nauthorized;
+
+    PROBE(nss__start, "getgrnam");
+    start = stats_begin();
+    gr = getgrnam(name);
+    stats_end(STATS_NSS, start);
+    PROBE(nss__done, "getgrnam", gr != NULL);
+    config.authorized_groups = xrealloc(config.authorized_groups,
+                                        (n + 1) * sizeof(char *));
+    config.authorized_gids = xrealloc(config.authorized_gids,
+                                      (n + 1) * sizeof(gid_t));
+    config.authorized_exists = xrealloc(config.authorized_exists,
+                                        (n + 1) * sizeof(bool));
+    config.authorized_groups[n] = strdup(name);
+    if (config.authorized_groups[n] == NULL) {
+        ERROR(_("Unable to allocate memory for loading "
+                "configuration file parameters\n"));
+        exit(EXIT_FAILURE);
+    }
+    config.authorized_exists[n] = (gr != NULL);
+    config.authorized_gids[n] = gr ? gr->gr_gid : (gid_t) - 1;
+    config.nauthorized++;
+}
+
+/*
+ * Read config file, with PROJECT_DIR, AUTHORIZED_GROUP and EXCLUDE
+ * parameters. All other lines are ignored.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ * */
+int read_config_file(const char *config_filename) {
+    FILE *fp;
+    char buf[MAXLINE];
+    char prm_name[MAXLINE], val[MAXLINE];
+
+    if ((fp = fopen(config_filename, "r")) == NULL) {
+        ERROR(_("Failed to open configuration file %s\n"), config_filename);
+        return -1;
+    }
+    while (fgets(buf, MAXLINE, fp) != NULL) {
+        if (buf[0] == '#' || sscanf(buf, "%s %s", prm_name, val) != 2) {
+            continue;
+        }
+        if (strcmp(prm_name, "PROJECT_DIR") == 0) {
+            add_project_parent(val);
+        } else if (strcmp(prm_name, "AUTHORIZED_GROUP") == 0) {
+            add_authorized_group(val);
+        } else if (strcmp(prm_name, "EXCLUDE") == 0 && exclude_add(val)) {
+            ERROR(_("Invalid exclude pattern '%s' in configuration file "
+                    "%s\n"), val, config_filename);
+            fclose(fp);
+            return -1;
+        }
+    }
+    if (ferror(fp)) {
+        ERROR(_("Unable to read configuration file %s\n"), config_filename);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    config.loaded = true;
+    return 0;
+}
+
+/**********************************************************
+ *                                                        *
+ *                      Helpers                           *
+ *                                                        *
+ **********************************************************/
+
+
+/*
+ * Cache of group names, only resolved for verbose messages.
+ */
+struct group_name {
+    gid_t gid;
+    char *name;
+};
+
+struct identity *identity;
+static struct group_name *group_names;
+static int ngroup_names;
+
+static int cmp_gid(const void *a, const void *b) {
+    gid_t ga = *(const gid_t *) a, gb = *(const gid_t *) b;
+
+    return (ga > gb) - (ga < gb);
+}
+
+void free_identity(struct identity *id) {
+    free(id->name);
+    free(id->groups);
+    free(id);
+}
+
+/*
+ * Resolve identity of user uid with NSS.
+ *
+ * Returns the newly allocated identity, or NULL if an error has been reported.
+ */
+struct identity *resolve_identity(uid_t uid) {
+    struct identity *id;
+    struct passwd *pw;
+    int ngroups = 0;
+    unsigned long long start;
+
+    PROBE(nss__start, "getpwuid");
+    start = stats_begin();
+    pw = getpwuid(uid);
+    stats_end(STATS_NSS, start);
+    PROBE(nss__done, "getpwuid", pw != NULL);
+    if (pw == NULL) {
+        PERROR(_("Error on getpwuid(): "));
+        return NULL;
+    }
+
+    id = xmalloc(sizeof(struct identity));
+    memset(id, 0, sizeof(struct identity));
+    id->name = strdup(pw->pw_name);
+    //this call is just to get the correct ngroups
+    PROBE(nss__start, "getgrouplist");
+    start = stats_begin();
+    getgrouplist(pw->pw_name, pw->pw_gid, NULL, &ngroups);
+    stats_end(STATS_NSS, start);
+    PROBE(nss__done, "getgrouplist", 1);
+    id->groups = xmalloc(sizeof(gid_t) * (ngroups ? ngroups : 1));
+    //here we actually get the groups
+    PROBE(nss__start, "getgrouplist");
+    start = stats_begin();
+    if (id->name == NULL
+        || getgrouplist(pw->pw_name, pw->pw_gid, id->groups, &ngroups) ==
+        -1) {
+        PROBE(nss__done, "getgrouplist", 0);
+        PERROR(_("Error on getgrouplist(): "));
+        free_identity(id);
+        return NULL;
+    }
+    stats_end(STATS_NSS, start);
+    PROBE(nss__done, "getgrouplist", 1);
+    qsort(id->groups, ngroups, sizeof(gid_t), cmp_gid);
+    id->ngroups = ngroups;
+
+    return id;
+}
+
+/*
+ * Returns the identity of the current user, resolving it on first call, or
+ * NULL if an error has been reported.
+ */
+struct identity *get_identity(void) {
+    if (identity == NULL)
+        identity = resolve_identity(owner);
+    return identity;
+}
+
+/*
+ * Returns the name of group gid for messages, or its gid if the group does
+ * not exist. Names are cached after first lookup.
+ */
+const char *get_group_name(gid_t gid) {
+    struct group *gr;
+    char *name;
+    unsigned long long start;
+
+    for (int i = 0; i < ngroup_names; i++) {
+        if (group_names[i].gid == gid)
+            return group_names[i].name;
+    }
+
+    PROBE(nss__start, "getgrgid");
+    start = stats_begin();
+    gr = getgrgid(gid);
+    stats_end(STATS_NSS, start);
+    PROBE(nss__done, "getgrgid", gr != NULL);
+    if (gr)
+        name = strdup(gr->gr_name);
+    else if (asprintf(&name, "%u", gid) == -1)
+        name = NULL;
+    if (name == NULL) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+    group_names = xrealloc(group_names,
+                           (ngroup_names + 1) * sizeof(struct group_name));
+    group_names[ngroup_names].gid = gid;
+    group_names[ngroup_names].name = name;
+    return group_names[ngroup_names++].name;
+}
+
+/*
+ * Returns true if current user is member of group gid, false otherwise.
+ */
+bool is_user_member(gid_t gid) {
+    struct identity *id = get_identity();
+
+    return id && bsearch(&gid, id->groups, id->ngroups, sizeof(gid_t),
+                         cmp_gid) != NULL;
+}
+
+/*
+ * Returns true if user is member of authorized group at index idx in
+ * configuration file, false otherwise.
+ */
+bool is_user_in_authorized_group(int idx) {
+
+    struct identity *id = get_identity();
+    char *agroup = config.authorized_groups[idx];
+    gid_t gid = config.authorized_gids[idx];
+
+    if (!config.authorized_exists[idx]) {
+        VERBOSE(_("Authorized group name %s don't exist!\n"), agroup);
+        VERBOSE(_
+                ("We assume User can't be a valid member of unexistent group!\n"));
+        return false;
+    }
+    if (id == NULL)
+        return false;
+
+    if (is_user_member(gid)) {
+        VERBOSE(_("User is a valid member of authorized group %s (%d)\n"),
+                agroup, gid);
+        return true;
+    }
+
+    VERBOSE(_("User %s is NOT a valid member of authorized group %s (%d)\n"),
+            id->name, agroup, gid);
+
+    return false;
+}
+
+/*
+ * Returns true if user is member of group whose gid is in a
+ * argument, false otherwise.
+ */
+bool is_user_in_group(gid_t gid) {
+
+    int count = 0;
+
+    STATS_INC(group_checks);
+    if (!config.nauthorized) {
+        // skip if no authorized group provided!
+        // assuming default to all rw group are authorized!
+        count = 1;
+    }
+    /* Start checking if User is a valid member of any authorized group!
+     * scanning the list of groups the user belongs to
+     * */
+    for (int i = 0; i < config.nauthorized; i++) {
+        if (is_user_in_authorized_group(i)) {
+            ++count;
+            break;
+        }
+    }
+
+    if (!count) {
+        VERBOSE(_("User is NOT a valid member of any authorized group!\n"));
+        return false;
+    }
+
+    if (is_user_member(gid)) {
+        VERBOSE(_("User is a valid member of group %s (%d)\n"),
+                get_group_name(gid), gid);
+        return true;
+    }
+    VERBOSE(_("User is NOT a valid member of group %s (%d)\n"),
+            get_group_name(gid), gid);
+    return false;
+}
+
+/*
+ * Returns true if path is under one of the projects parents declared in
+ * configuration. If true, project_parent string is set with the matching
+ * project parent. Paths are compared component-wise in the projects parents
+ * index, the deepest project parent containing path is selected.
+ *
+ * The project_parent argument must be a preallocated string and path must be
+ * a canonical absolute path (see realpath(3)).
+ *
+ * Examples:
+ *
+ *   With:
+ *
+ *     PROJECT_DIR /projects
+ *     PROJECT_DIR /data
+ *     path = '/projects/awesome/data'
+ *
+ *     → is_in_projects_parents() returs true and set project_parent to '/projects'.
+ *
+ *   With:
+ *
+ *     PROJECT_DIR /projects
+ *     PROJECT_DIR /data
+ *     path = '/tmp/file'
+ *
+ *     → is_in_projects_parents() returns false (project_parent is not modified).
+ */
+
+bool is_in_projects_parents(char *project_parent, const char *path) {
+
+    struct parent_node *node = &config.parents;
+    const char *p = path;
+    size_t match = 0;           /* length of matching project parent */
+    bool found = false;
+
+    for (;;) {
+        const char *name, *end;
+        char component[NAME_MAX + 1];
+
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
+
+        //if file in list of projects but not equal the project
+        if (node->is_parent) {
+            match = p - path;
+            found = true;
+        }
+
+        name = p;
+        end = strchrnul(name, '/');
+        if ((size_t) (end - name) > NAME_MAX)
+            break;
+        memcpy(component, name, end - name);
+        component[end - name] = '\0';
+        if ((node = parent_node_child(node, component)) == NULL)
+            break;
+        p = end;
+    }
+
+    if (!found)
+        return false;
+
+    /* remove trailing slashes, except for / */
+    while (match > 1 && path[match - 1] == '/')
+        match--;
+    memcpy(project_parent, path, match);
+    project_parent[match] = '\0';
+    return true;
+}
+
+/*
+ * Set project_root with the path of the root directory of the project
+ * located under project_parent and containing the path in argument.
+ *
+ * Example:
+ *
+ *    With:
+ *
+ *      project_parent = '/projects'
+ *      path = '/projects/awesome/path/to/file'
+ *
+ *    → project_root is '/projects/awesome'
+ */
+
+void get_project_root(char *project_parent, char *path, char *project_root) {
+
+    // get the path of project
+    int l = strlen(project_parent);
+    int h = l + 1;
+
+    /* clean allocated memory for strings */
+    memset(project_root, 0, PATH_MAX);
+
+    while (path[h] != '\0' && path[h] != '/') {
+        h++;
+    }
+    strcpy(project_root, project_parent);
+    /* concat with the basename of project directory */
+    strncat(project_root, &path[l], h - l);
+
+    VERBOSE(_("Project path: %s\n"), project_root);
+
+}
+
+/*
+ * Access ACL of project roots are read directly in their extended attribute,
+ * whose format is (see linux/posix_acl_xattr.h):
+ *
+ *   <version: le32>
+ *   <tag: le16> <perm: le16> <id: le32>
+ *   …
+ *
+ * The groups with write permission are decoded in a single pass and memoized
+ * per project root inode, so authorizing many paths in the same project costs
+ * one extended attribute read. Changing the ACL updates the change time of the
+ * inode, the memoized groups are read again when it differs, so that revoked
+ * permissions are enforced in long-running processes.
+ */
+
+#define ACL_XATTR_ACCESS "system.posix_acl_access"
+#define ACL_XATTR_VERSION 2
+#define ACL_XATTR_GROUP 0x08
+#define ACL_XATTR_WRITE 0x02
+
+struct acl_xattr_entry {
+    uint16_t tag;
+    uint16_t perm;
+    uint32_t id;
+};
+
+struct acl_groups {
+    dev_t dev;
+    ino_t ino;
+    struct timespec ctime;      /* change time when ACL was read */
+    gid_t *gids;                /* groups with write permission */
+    size_t ngids;
+};
+
+static struct acl_groups *acl_cache;   /* sorted by inode */
+static size_t nacl_cache;
+
+static int cmp_acl_groups(const void *a, const void *b) {
+    const struct acl_groups *ga = a, *gb = b;
+
+    if (ga->dev != gb->dev)
+        return ga->dev < gb->dev ? -1 : 1;
+    return (ga->ino > gb->ino) - (ga->ino < gb->ino);
+}
+
+/*
+ * Decode the groups with write permission of ACL extended attribute value
+ * of size len in groups.
+ *
+ * Returns 0 on success, -1 if the value is invalid.
+ */
+static int acl_decode(const char *value, size_t len,
+                      struct acl_groups *groups) {
+    struct acl_xattr_entry entry;
+    uint32_t version;
+
+    if (len < sizeof(version)
+        || (len - sizeof(version)) % sizeof(entry))
+        return -1;
+    memcpy(&version, value, sizeof(version));
+    if (le32toh(version) != ACL_XATTR_VERSION)
+        return -1;
+
+    groups->gids = xmalloc((len - sizeof(version)) / sizeof(entry)
+                           * sizeof(gid_t) + 1);
+    for (size_t off = sizeof(version); off < len; off += sizeof(entry)) {
+        memcpy(&entry, value + off, sizeof(entry));
+        if (le16toh(entry.tag) == ACL_XATTR_GROUP
+            && le16toh(entry.perm) & ACL_XATTR_WRITE)
+            groups->gids[groups->ngids++] = le32toh(entry.id);
+    }
+    return 0;
+}
+
+/*
+ * Returns the groups with write permission in the access ACL of project_root
+ * whose status is sb, reading its extended attribute on first call for this
+ * inode or when its change time differs.
+ */
+struct acl_groups *get_acl_groups(const char *project_root,
+                                  const struct stat *sb) {
+    struct acl_groups key = {.dev = sb->st_dev, .ino = sb->st_ino,
+        .ctime = sb->st_ctim }, *groups;
+    char buf[1024], *value = buf;
+    ssize_t len;
+    size_t pos = 0;
+    unsigned long long start;
+
+    groups = bsearch(&key, acl_cache, nacl_cache, sizeof(struct acl_groups),
+                     cmp_acl_groups);
+    if (groups && groups->ctime.tv_sec == key.ctime.tv_sec
+        && groups->ctime.tv_nsec == key.ctime.tv_nsec)
+        return groups;
+
+    PROBE(acl__start, project_root);
+    start = stats_begin();
+    len = getxattr(project_root, ACL_XATTR_ACCESS, buf, sizeof(buf));
+    if (len == -1 && errno == ERANGE
+        && (len = getxattr(project_root, ACL_XATTR_ACCESS, NULL, 0)) > 0) {
+        value = xmalloc(len);
+        len = getxattr(project_root, ACL_XATTR_ACCESS, value, len);
+    }
+    stats_end(STATS_ACL, start);
+    PROBE(acl__done, project_root, len);
+
+    /* without extended ACL, no group has write permission */
+    if (len == -1 && errno != ENODATA && errno != ENOTSUP)
+        PERROR(_("Error on getxattr()"));
+    else if (len != -1 && acl_decode(value, len, &key))
+        ERROR(_("Invalid ACL on %s\n"), project_root);
+    if (value != buf)
+        free(value);
+
+    /* outdated groups are replaced */
+    if (groups) {
+        free(groups->gids);
+        *groups = key;
+        return groups;
+    }
+    while (pos < nacl_cache && cmp_acl_groups(&acl_cache[pos], &key) < 0)
+        pos++;
+    acl_cache = xrealloc(acl_cache,
+                         (nacl_cache + 1) * sizeof(struct acl_groups));
+    memmove(&acl_cache[pos + 1], &acl_cache[pos],
+            (nacl_cache - pos) * sizeof(struct acl_groups));
+    nacl_cache++;
+    acl_cache[pos] = key;
+    return &acl_cache[pos];
+}
+
+/*
+ * Check the current user is a valid administrator of the project, ie. she/he
+ * is a member of the project group owner of the project root directory, or
+ * of a group with write permission in its ACL.
+ *
+ * Returns 1 if granted, 0 if denied, -1 if an error has been reported.
+ */
+
+int check_project_admin(const char *project_root) {
+
+    struct stat sb;
+    struct acl_groups *groups;
+    bool granted = false;
+    int ret;
+    unsigned long long start;
+
+    STATS_INC(auth_checks);
+    PROBE(auth__start, project_root);
+
+    /* Get gid of group owner of project root directory */
+    start = stats_begin();
+    ret = stat(project_root, &sb);
+    stats_end(STATS_STAT, start);
+    if (ret == -1) {
+        PERROR(_("Error on stat()"));
+        PROBE(auth__done, project_root, false);
+        return -1;
+    }
+
+    VERBOSE(_("Project group owner: %s (%d)\n"), get_group_name(sb.st_gid),
+            sb.st_gid);
+
+    /* Return true if user is member of group owner of project root directory */
+    if (is_user_in_group(sb.st_gid)) {
+        granted = true;
+    } else {
+        VERBOSE(_("Checking ACL\n"));
+
+        groups = get_acl_groups(project_root, &sb);
+        for (size_t i = 0; i < groups->ngids && !granted; i++)
+            granted = is_user_in_group(groups->gids[i]);
+    }
+    PROBE(auth__done, project_root, granted);
+    return granted;
+}
+
+/*
+ * Returns true if the current user is a valid administrator of the project,
+ * false if denied or on error.
+ */
+bool is_user_project_admin(const char *project_root) {
+    return check_project_admin(project_root) == 1;
+}
+
+/**********************************************************
+ *                                                        *
+ *                        Plans                           *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * With --plan, the tree is scanned without any modification and the entries
+ * whose owner or mode would be changed are written in a plan file. The plan
+ * is then replayed with --apply, without walking the tree again.
+ *
+ * Plan file format is:
+ *
+ *   prown-plan 1\n
+ *   <uid>\n
+ *   <root path>\0
+ *   <dev> <ino> <mode> <uid> <shared> <suffix>\0
+ *   …
+ *
+ * with the uid of the user who has created the plan, and for each path given
+ * to prown, its root path followed by one record per entry to change: its
+ * device, inode, mode (octal) and owner when scanned and its path relative to
+ * root, front coded as in checkpoint files. An empty path is the root itself.
+ *
+ * Workers record the entries of a directory in a thread local batch, written
+ * at once in the plan when the directory is completed.
+ */
+
+#define PLAN_MAGIC "prown-plan 1\n"
+
+struct plan_record {
+    struct entry_stat est;
+    char *path;                 /* relative to plan root */
+};
+
+static struct {
+    FILE *fp;
+    const char *filename;
+    pthread_mutex_t lock;
+    size_t rootlen;             /* length of current root path */
+    char *prev;                 /* last path written */
+} plan = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct {
+    struct plan_record *records;
+    size_t nrecords;
+    size_t size;
+} plan_batch;
+
+/*
+ * Create plan file.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+int plan_open(const char *filename) {
+    if ((plan.fp = fopen(filename, "w")) == NULL) {
+        ERROR(_("Failed to open plan file %s: %s\n"), filename,
+              strerror(errno));
+        return -1;
+    }
+    plan.filename = filename;
+    fprintf(plan.fp, PLAN_MAGIC "%u\n", (unsigned) owner);
+    return 0;
+}
+
+/*
+ * Start the records of entries under root path in plan.
+ */
+void plan_root(const char *root) {
+    pthread_mutex_lock(&plan.lock);
+    fputs(root, plan.fp);
+    fputc('\0', plan.fp);
+    plan.rootlen = strlen(root);
+    free(plan.prev);
+    plan.prev = NULL;
+    pthread_mutex_unlock(&plan.lock);
+}
+
+/*
+ * Record entry name of directory dir (or root of plan if dir is NULL) in the
+ * batch of current thread if its owner or mode would be changed by
+ * changeOwner(). Counters are updated as if the changes were performed.
+ *
+ * Returns 0.
+ */
+int plan_entry(const struct walk_task *dir, const char *name,
+               const char *path, const struct entry_stat *est) {
+    bool need_chown = est->uid != owner;
+    bool need_chmod = !S_ISLNK(est->mode)
+        && (est->mode & (S_IRGRP | S_IWGRP)) != (S_IRGRP | S_IWGRP);
+    struct plan_record *record;
+
+    if (!need_chown && !need_chmod) {
+        atomic_fetch_add_explicit(&counters.compliant, 1,
+                                  memory_order_relaxed);
+        return 0;
+    }
+    if (need_chown) {
+        VERBOSE(_("Planning to change owner of path %s\n"), path);
+        atomic_fetch_add_explicit(&counters.chowned, 1,
+                                  memory_order_relaxed);
+    }
+    if (need_chmod) {
+        VERBOSE(_("Planning to ensure group owner has rw permissions on path "
+                  "%s\n"), path);
+        atomic_fetch_add_explicit(&counters.chmoded, 1,
+                                  memory_order_relaxed);
+    }
+
+    if (plan_batch.nrecords == plan_batch.size) {
+        plan_batch.size = plan_batch.size ? plan_batch.size * 2 : 16;
+        plan_batch.records = xrealloc(plan_batch.records, plan_batch.size *
+                                      sizeof(struct plan_record));
+    }
+    record = &plan_batch.records[plan_batch.nrecords++];
+    record->est = *est;
+    if (dir) {
+        char *full = walk_path(dir, name);
+
+        record->path = xmalloc(strlen(full) - plan.rootlen);
+        strcpy(record->path, full + plan.rootlen + 1);
+        free(full);
+    } else {
+        record->path = xmalloc(1);
+        *record->path = '\0';
+    }
+    return 0;
+}
+
+/*
+ * Write the records of current thread batch in plan.
+ */
+void plan_flush(void) {
+    if (!plan_batch.nrecords)
+        return;
+    pthread_mutex_lock(&plan.lock);
+    for (size_t i = 0; i < plan_batch.nrecords; i++) {
+        struct plan_record *record = &plan_batch.records[i];
+        size_t shared = 0;
+
+        while (plan.prev && plan.prev[shared]
+               && plan.prev[shared] == record->path[shared])
+            shared++;
+        fprintf(plan.fp, "%ju %ju %o %u %zu %s", (uintmax_t) record->est.dev,
+                (uintmax_t) record->est.ino, (unsigned) record->est.mode,
+                (unsigned) record->est.uid, shared, record->path + shared);
+        fputc('\0', plan.fp);
+        free(plan.prev);
+        plan.prev = record->path;
+    }
+    pthread_mutex_unlock(&plan.lock);
+    free(plan_batch.records);
+    memset(&plan_batch, 0, sizeof(plan_batch));
+}
+
+/*
+ * Close plan file.
+ *
+ * Returns 0 on success, -1 if a write error has been reported.
+ */
+int plan_close(void) {
+    int rc = 0;
+
+    free(plan.prev);
+    plan.prev = NULL;
+    if (ferror(plan.fp) | fclose(plan.fp)) {
+        ERROR(_("Failed to write plan file %s\n"), plan.filename);
+        rc = -1;
+    }
+    plan.fp = NULL;
+    return rc;
+}
+
+/**********************************************************
+ *                                                        *
+ *                        Journal                         *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * With --journal, the changes performed on entries are recorded in an
+ * append-only binary journal, so they can be reverted with --undo.
+ *
+ * Journal file format, in native byte order, is:
+ *
+ *   struct journal_header
+ *   struct journal_record
+ *   <path>
+ *   …
+ *
+ * with the uid of the user who has performed the changes in the header, and
+ * for each changed entry a record with its device, inode, owner and mode
+ * before and after the change, and the length of its absolute path which
+ * immediately follows the record without terminating NUL. The records of
+ * successive runs are appended to the same journal.
+ *
+ * Threads append records to a thread local buffer. Full buffers are queued to
+ * a writer thread which writes each of them with a single write(), threads
+ * only wait for the disk when JOURNAL_QUEUE buffers are already queued.
+ */
+
+#define JOURNAL_MAGIC "prown-journal 1\n"
+#define JOURNAL_BUFFER (1 << 20)
+#define JOURNAL_QUEUE 8
+
+struct journal_header {
+    char magic[16];
+    uint32_t uid;
+    uint32_t reserved;
+};
+
+struct journal_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t old_uid;
+    uint32_t old_mode;
+    uint32_t new_uid;
+    uint32_t new_mode;
+    uint32_t pathlen;
+    uint32_t reserved;
+};
+
+struct journal_buffer {
+    struct journal_buffer *next;
+    size_t len;
+    size_t size;
+    char data[];
+};
+
+static struct {
+    int fd;
+    const char *filename;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* queue changed or journal closing */
+    struct journal_buffer *head;        /* queue of buffers to write */
+    struct journal_buffer *tail;
+    struct journal_buffer *free;        /* buffers written, to recycle */
+    int queued;
+    bool closing;
+    int error;                  /* errno of the first write error */
+} journal = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct journal_buffer *journal_current;
+
+int journal_close(void);
+static void journal_atexit(void);
+
+/*
+ * Write the queued buffers in journal until it is closed.
+ */
+static void *journal_writer(void *arg) {
+    struct journal_buffer *buffer;
+
+    (void) arg;
+    pthread_mutex_lock(&journal.lock);
+    for (;;) {
+        while (journal.head == NULL && !journal.closing)
+            pthread_cond_wait(&journal.cond, &journal.lock);
+        if ((buffer = journal.head) == NULL)
+            break;
+        if ((journal.head = buffer->next) == NULL)
+            journal.tail = NULL;
+        pthread_mutex_unlock(&journal.lock);
+
+        if (!journal.error
+            && write_full(journal.fd, buffer->data, buffer->len))
+            journal.error = errno ? errno : EIO;
+
+        pthread_mutex_lock(&journal.lock);
+        journal.queued--;
+        if (buffer->size == JOURNAL_BUFFER) {
+            buffer->next = journal.free;
+            journal.free = buffer;
+        } else {
+            free(buffer);
+        }
+        pthread_cond_broadcast(&journal.cond);
+    }
+    pthread_mutex_unlock(&journal.lock);
+    return NULL;
+}
+
+/*
+ * Open journal file, creating it if required, and start the writer thread.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+int journal_open(const char *filename) {
+    struct journal_header header;
+    struct stat st;
+
+    journal.fd = open(filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                      0600);
+    if (journal.fd == -1 || fstat(journal.fd, &st)) {
+        ERROR(_("Failed to open journal file %s: %s\n"), filename,
+              strerror(errno));
+        goto error;
+    }
+    journal.filename = filename;
+    memset(&header, 0, sizeof(header));
+    if (st.st_size == 0) {
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.uid = owner;
+        if (write_full(journal.fd, &header, sizeof(header))) {
+            ERROR(_("Failed to write journal file %s: %s\n"), filename,
+                  strerror(errno));
+            goto error;
+        }
+    } else {
+        if (pread(journal.fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic))) {
+            ERROR(_("Invalid journal file %s\n"), filename);
+            goto error;
+        }
+        if (header.uid != owner) {
+            ERROR(_("Journal file %s has been created by another user\n"),
+                  filename);
+            goto error;
+        }
+    }
+    if (pthread_create(&journal.writer, NULL, journal_writer, NULL)) {
+        ERROR(_("Unable to create journal writer thread\n"));
+        goto error;
+    }
+    /* pending records are still written when leaving on error */
+    atexit(journal_atexit);
+    return 0;
+
+  error:
+    if (journal.fd != -1)
+        close(journal.fd);
+    journal.fd = -1;
+    return -1;
+}
+
+/*
+ * Queue the buffer of current thread to the writer.
+ */
+void journal_flush(void) {
+    struct journal_buffer *buffer = journal_current;
+
+    if (buffer == NULL)
+        return;
+    journal_current = NULL;
+    pthread_mutex_lock(&journal.lock);
+    while (journal.queued >= JOURNAL_QUEUE)
+        pthread_cond_wait(&journal.cond, &journal.lock);
+    buffer->next = NULL;
+    if (journal.tail)
+        journal.tail->next = buffer;
+    else
+        journal.head = buffer;
+    journal.tail = buffer;
+    journal.queued++;
+    pthread_cond_broadcast(&journal.cond);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/*
+ * Record the change of the entry at path (or name in directory of task dir if
+ * path is NULL) from status old to status new.
+ */
+void journal_change(const struct walk_task *dir, const char *name,
+                    const char *path, const struct entry_stat *old,
+                    const struct entry_stat *new) {
+    struct journal_record record;
+    char *full = path ? NULL : walk_path(dir, name);
+    size_t len, size;
+
+    if (full)
+        path = full;
+    len = strlen(path);
+    size = sizeof(record) + len;
+    if (journal_current
+        && journal_current->len + size > journal_current->size)
+        journal_flush();
+    if (journal_current == NULL) {
+        size_t bufsize = size > JOURNAL_BUFFER ? size : JOURNAL_BUFFER;
+
+        pthread_mutex_lock(&journal.lock);
+        if (bufsize == JOURNAL_BUFFER && (journal_current = journal.free))
+            journal.free = journal_current->next;
+        pthread_mutex_unlock(&journal.lock);
+        if (journal_current == NULL)
+            journal_current = xmalloc(sizeof(struct journal_buffer)
+                                      + bufsize);
+        journal_current->len = 0;
+        journal_current->size = bufsize;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.dev = old->dev;
+    record.ino = old->ino;
+    record.old_uid = old->uid;
+    record.old_mode = old->mode;
+    record.new_uid = new->uid;
+    record.new_mode = new->mode;
+    record.pathlen = len;
+    memcpy(journal_current->data + journal_current->len, &record,
+           sizeof(record));
+    memcpy(journal_current->data + journal_current->len + sizeof(record),
+           path, len);
+    journal_current->len += size;
+    free(full);
+}
+
+/*
+ * Write pending records and close journal.
+ *
+ * Returns 0 on success, -1 if a write error has been reported.
+ */
+int journal_close(void) {
+    struct journal_buffer *buffer;
+
+    if (journal.fd == -1)
+        return 0;
+    journal_flush();
+    pthread_mutex_lock(&journal.lock);
+    journal.closing = true;
+    pthread_cond_broadcast(&journal.cond);
+    pthread_mutex_unlock(&journal.lock);
+    pthread_join(journal.writer, NULL);
+    while ((buffer = journal.free)) {
+        journal.free = buffer->next;
+        free(buffer);
+    }
+    if (close(journal.fd) && !journal.error)
+        journal.error = errno;
+    journal.fd = -1;
+    if (journal.error) {
+        ERROR(_("Failed to write journal file %s: %s\n"), journal.filename,
+              strerror(journal.error));
+        return -1;
+    }
+    return 0;
+}
+
+static void journal_atexit(void) {
+    journal_close();
+}
+
+/**********************************************************
+ *                                                        *
+ *                   Structured output                    *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * With --output=ndjson, one JSON record is written on standard output per
+ * changed or failed entry, followed by a summary record at the end:
+ *
+ *   {"type":"entry","path":"/p/a","old_uid":1001,"new_uid":1002,
+ *    "old_mode":33188,"new_mode":33204,"error":0}
+ *   {"type":"summary","entries":2,...}
+ *
+ * Modes are st_mode values and error is the errno of the failure, 0 if the
+ * entry has been changed. Paths bytes which are not valid UTF-8 are escaped
+ * as \u00XX.
+ *
+ * Threads format records in a thread local buffer, which is copied in a
+ * large ring buffer when it is full and at the end of walks. A writer thread
+ * writes the content of the ring on standard output, so walkers only wait for
+ * output when the ring is full.
+ */
+
+#define OUTPUT_RING (16 << 20)
+#define OUTPUT_BUFFER (64 << 10)
+/* largest record but the path: fixed text and numbers */
+#define OUTPUT_RECORD_MAX 192
+
+enum output_format output_format;
+
+static struct {
+    bool enabled;
+    char *ring;
+    size_t head;                /* bytes queued in ring, never wraps */
+    size_t tail;                /* bytes written by writer */
+    pthread_t writer;
+    pthread_mutex_t flush_lock; /* threads copying their records */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* ring changed or output closing */
+    bool closing;
+    int error;                  /* errno of the first write error */
+} output = {
+    .flush_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread struct {
+    char *data;
+    size_t len;
+} output_local;
+
+static void output_atexit(void);
+
+/*
+ * Write the content of the ring on standard output until it is closed.
+ */
+static void *output_writer(void *arg) {
+    size_t len, pos;
+
+    (void) arg;
+    pthread_mutex_lock(&output.lock);
+    for (;;) {
+        while (output.head == output.tail && !output.closing)
+            pthread_cond_wait(&output.cond, &output.lock);
+        if (output.head == output.tail)
+            break;
+        /* contiguous part of queued bytes */
+        pos = output.tail % OUTPUT_RING;
+        len = output.head - output.tail;
+        if (len > OUTPUT_RING - pos)
+            len = OUTPUT_RING - pos;
+        pthread_mutex_unlock(&output.lock);
+
+        if (!output.error
+            && write_full(STDOUT_FILENO, output.ring + pos, len))
+            output.error = errno ? errno : EIO;
+
+        pthread_mutex_lock(&output.lock);
+        output.tail += len;
+        pthread_cond_broadcast(&output.cond);
+    }
+    pthread_mutex_unlock(&output.lock);
+    return NULL;
+}
+
+/*
+ * Start the writer of structured output.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+int output_open(void) {
+    if (output_format != OUTPUT_NDJSON)
+        return 0;
+    output.ring = xmalloc(OUTPUT_RING);
+    fflush(stdout);
+    if (pthread_create(&output.writer, NULL, output_writer, NULL)) {
+        ERROR(_("Unable to create output writer thread\n"));
+        free(output.ring);
+        output.ring = NULL;
+        return -1;
+    }
+    output.enabled = true;
+    /* pending records are still written when leaving on error */
+    atexit(output_atexit);
+    return 0;
+}
+
+/*
+ * Copy the records of current thread in the ring, waiting for the writer
+ * while the ring is full. Threads copy their records one at a time, so the
+ * records are not mixed.
+ */
+void output_flush(void) {
+    const char *data = output_local.data;
+    size_t len = output_local.len, pos, n;
+
+    if (len == 0)
+        return;
+    pthread_mutex_lock(&output.flush_lock);
+    pthread_mutex_lock(&output.lock);
+    while (len) {
+        while (output.head - output.tail == OUTPUT_RING)
+            pthread_cond_wait(&output.cond, &output.lock);
+        pos = output.head % OUTPUT_RING;
+        n = OUTPUT_RING - (output.head - output.tail);
+        if (n > OUTPUT_RING - pos)
+            n = OUTPUT_RING - pos;
+        if (n > len)
+            n = len;
+        memcpy(output.ring + pos, data, n);
+        output.head += n;
+        data += n;
+        len -= n;
+        pthread_cond_broadcast(&output.cond);
+    }
+    pthread_mutex_unlock(&output.lock);
+    pthread_mutex_unlock(&output.flush_lock);
+    output_local.len = 0;
+}
+
+/*
+ * Append path in JSON string to buffer p, returns the end of the string.
+ * The buffer must have room for 6 bytes per byte of path.
+ */
+static char *output_json_string(char *p, const char *path) {
+    const unsigned char *s = (const unsigned char *) path;
+
+    *p++ = '"';
+    while (*s) {
+        unsigned char c = *s;
+        int n = 0;
+
+        /* length of valid UTF-8 sequence starting at s, 0 if invalid */
+        if (c >= 0xc2 && c <= 0xdf)
+            n = 2;
+        else if (c >= 0xe0 && c <= 0xef)
+            n = 3;
+        else if (c >= 0xf0 && c <= 0xf4)
+            n = 4;
+        for (int i = 1; i < n; i++)
+            if ((s[i] & 0xc0) != 0x80)
+                n = 0;
+        if (n && ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] >= 0xa0)
+                  || (c == 0xf0 && s[1] < 0x90)
+                  || (c == 0xf4 && s[1] >= 0x90)))
+            n = 0;          /* overlong, surrogate or beyond U+10FFFF */
+
+        if (n) {
+            memcpy(p, s, n);
+            p += n;
+            s += n;
+            continue;
+        }
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = c;
+        }
+        s++;
+    }
+    *p++ = '"';
+    return p;
+}
+
+/*
+ * Record the change or the failure with errno error of the entry at path (or
+ * name in directory of task dir if path is NULL) from status old to status
+ * new.
+ */
+void output_entry(const struct walk_task *dir, const char *name,
+                  const char *path, const struct entry_stat *old,
+                  const struct entry_stat *new, int error) {
+    char *full = path ? NULL : walk_path(dir, name), *p;
+    size_t size;
+
+    if (full)
+        path = full;
+    size = strlen(path) * 6 + OUTPUT_RECORD_MAX;
+    if (output_local.len + size > OUTPUT_BUFFER)
+        output_flush();
+    if (output_local.data == NULL)
+        output_local.data = xmalloc(OUTPUT_BUFFER);
+    if (size > OUTPUT_BUFFER) {
+        /* path too long for the buffer, the record is written alone */
+        output_local.data = xrealloc(output_local.data, size);
+    }
+    p = output_local.data + output_local.len;
+    p += sprintf(p, "{\"type\":\"entry\",\"path\":");
+    p = output_json_string(p, path);
+    p += sprintf(p, ",\"old_uid\":%u,\"new_uid\":%u,\"old_mode\":%u,"
+                 "\"new_mode\":%u,\"error\":%d}\n", (unsigned) old->uid,
+                 (unsigned) new->uid, (unsigned) old->mode,
+                 (unsigned) new->mode, error);
+    output_local.len = p - output_local.data;
+    if (size > OUTPUT_BUFFER) {
+        output_flush();
+        output_local.data = xrealloc(output_local.data, OUTPUT_BUFFER);
+    }
+    free(full);
+}
+
+/*
+ * Write the summary record and pending records, and stop the writer.
+ *
+ * Returns 0 on success, -1 if a write error has been reported.
+ */
+int output_close(void) {
+    char record[512];
+
+    if (!output.enabled)
+        return 0;
+    output.enabled = false;
+    output_flush();
+    free(output_local.data);
+    snprintf(record, sizeof(record), "{\"type\":\"summary\","
+             "\"directories\":%llu,\"entries\":%zu,\"chowned\":%zu,"
+             "\"chmoded\":%zu,\"compliant\":%zu,\"hardlinks\":%zu,"
+             "\"pruned\":%zu,\"unchanged\":%zu,\"errors\":%llu}\n",
+             STATS_SUM(directories), atomic_load(&counters.entries),
+             atomic_load(&counters.chowned), atomic_load(&counters.chmoded),
+             atomic_load(&counters.compliant),
+             atomic_load(&counters.hardlinks), atomic_load(&counters.pruned),
+             atomic_load(&counters.unchanged), STATS_SUM(errors));
+    output_local.data = record;
+    output_local.len = strlen(record);
+    output_flush();
+    output_local.data = NULL;
+
+    pthread_mutex_lock(&output.lock);
+    output.closing = true;
+    pthread_cond_broadcast(&output.cond);
+    pthread_mutex_unlock(&output.lock);
+    pthread_join(output.writer, NULL);
+    free(output.ring);
+    output.ring = NULL;
+    if (output.error) {
+        ERROR(_("Failed to write output: %s\n"), strerror(output.error));
+        return -1;
+    }
+    return 0;
+}
+
+static void output_atexit(void) {
+    output_close();
+}
+
+/**********************************************************
+ *                                                        *
+ *                    Visited inodes                      *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * Files with multiple hard links are processed only once per run. Their
+ * identities are recorded in a set split in shards, each one an open
+ * addressing hash table with linear probing protected by its own lock, so
+ * workers rarely contend.
+ *
+ * Only files with more than one link are recorded, with the number of their
+ * links not visited yet. When all links of a file have been visited, its slot
+ * becomes a tombstone: it still matches the file in case of new links but is
+ * dropped when the table is resized. The set memory is then bounded by the
+ * number of files with links not visited yet, not by the size of the tree.
+ */
+
+#define VISITED_SHARDS_BITS 6
+#define VISITED_SHARDS (1 << VISITED_SHARDS_BITS)
+#define VISITED_MIN_SIZE 64
+
+struct visited_slot {
+    dev_t dev;
+    ino_t ino;                  /* 0 for empty slots */
+    nlink_t left;               /* links not visited yet, 0 for tombstones */
+};
+
+struct visited_shard {
+    pthread_mutex_t lock;
+    struct visited_slot *slots;
+    size_t size;                /* power of 2 */
+    size_t used;                /* live slots and tombstones */
+    size_t live;
+} __attribute__((aligned(64)));
+
+static struct visited_shard visited[VISITED_SHARDS] = {
+    [0 ... VISITED_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+static uint64_t visited_hash(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL;
+
+    h ^= (uint64_t) dev + 0x7f4a7c159e3779b9ULL + (h << 6) + (h >> 2);
+    return h ^ (h >> 29);
+}
+
+/*
+ * Rehash live slots of shard in a table sized for twice their number,
+ * tombstones are dropped.
+ */
+static void visited_resize(struct visited_shard *shard) {
+    struct visited_slot *slots = shard->slots;
+    size_t size = shard->size, newsize = VISITED_MIN_SIZE;
+
+    while (newsize < shard->live * 4)
+        newsize *= 2;
+    shard->slots = xmalloc(newsize * sizeof(struct visited_slot));
+    memset(shard->slots, 0, newsize * sizeof(struct visited_slot));
+    shard->size = newsize;
+    shard->used = shard->live;
+    for (size_t i = 0; i < size; i++) {
+        size_t j;
+
+        if (!slots[i].ino || !slots[i].left)
+            continue;
+        j = visited_hash(slots[i].dev, slots[i].ino) & (newsize - 1);
+        while (shard->slots[j].ino)
+            j = (j + 1) & (newsize - 1);
+        shard->slots[j] = slots[i];
+    }
+    free(slots);
+}
+
+/*
+ * Record a visit of the entry with status est, which must have more than one
+ * link.
+ *
+ * Returns true on the first visit of the entry, false if it has already been
+ * visited through another link.
+ */
+static bool visited_add(const struct entry_stat *est) {
+    uint64_t h = visited_hash(est->dev, est->ino);
+    struct visited_shard *shard = &visited[h >> (64 - VISITED_SHARDS_BITS)];
+    struct visited_slot *slot;
+    bool first = false;
+    size_t i;
+
+    pthread_mutex_lock(&shard->lock);
+    /* keep load factor under 3/4 */
+    if ((shard->used + 1) * 4 > shard->size * 3)
+        visited_resize(shard);
+    for (i = h & (shard->size - 1);; i = (i + 1) & (shard->size - 1)) {
+        slot = &shard->slots[i];
+        if (!slot->ino) {
+            slot->dev = est->dev;
+            slot->ino = est->ino;
+            slot->left = est->nlink - 1;
+            shard->used++;
+            shard->live++;
+            first = true;
+            break;
+        }
+        if (slot->ino == est->ino && slot->dev == est->dev) {
+            if (slot->left && !--slot->left)
+                shard->live--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return first;
+}
+
+/*
+ * Forget all visited entries, at the end of a library walk.
+ */
+static void visited_clear(void) {
+    for (int i = 0; i < VISITED_SHARDS; i++) {
+        free(visited[i].slots);
+        visited[i].slots = NULL;
+        visited[i].size = visited[i].used = visited[i].live = 0;
+    }
+}
+
+/**********************************************************
+ *                                                        *
+ *                   Incremental index                    *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * With --incremental, the directories whose entries are all compliant at the
+ * end of the run are recorded in an index file, with their identity, their
+ * modification and change times when they were opened and the names of their
+ * subdirectories. On the next run, a directory whose status still matches
+ * its record has the same entries: its content is not read again and only its
+ * recorded subdirectories are processed. The work of a run then depends on
+ * the number of directories and on the amount of changes, not on the number
+ * of files.
+ *
+ * Creating, removing or renaming entries changes the times of the directory,
+ * so it is processed again. Changes of owner or mode of existing entries do
+ * not modify their directory: a chmod by the user who ran prown, now owner of
+ * the files, a prown run by another administrator of the project or a chown
+ * by root are not detected until the directory itself changes. Detecting them
+ * requires a stat of every entry, ie. a run without the index. Directories
+ * whose entries are not all processed (excluded, beyond maximum depth, on
+ * another filesystem or already being walked) are never recorded, so that
+ * runs with other options do not skip them.
+ *
+ * Index file format, in native byte order, is:
+ *
+ *   struct incremental_header
+ *   struct incremental_record
+ *   <subdirectories names>
+ *   …
+ *
+ * with the uid of the user and the shard in the header, and for each
+ * directory a record followed by the NUL terminated names of its
+ * subdirectories, padded to 8 bytes. The index is written again at the end
+ * of each run with the directories processed in this run, so the same paths
+ * must be given to all the runs sharing an index file. The index is written by
+ * the user, the names of its records are rejected unless they are names of
+ * entries in the recorded directory, which a full walk processes anyway.
+ */
+
+#define INCREMENTAL_MAGIC "prown-index 1\n\0"
+#define INCREMENTAL_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+struct incremental_header {
+    char magic[16];
+    uint32_t uid;
+    int32_t shard_index;        /* shard of the run, subdirectories names */
+    int32_t shard_count;        /* of other shards are not recorded */
+    int32_t shard_depth;
+};
+
+struct incremental_record {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t nsubdirs;
+    uint32_t nameslen;          /* length of names, padding excluded */
+};
+
+static struct {
+    const char *filename;
+    char *data;                 /* records of the previous run */
+    size_t len;
+    size_t *slots;              /* offsets of records + 1, 0 if empty */
+    size_t size;                /* power of 2 */
+    pthread_mutex_t lock;
+    char *out;                  /* records of this run */
+    size_t outlen;
+    size_t outsize;
+} incremental = {.lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Load the index of previous run in file filename if it exists, and record
+ * the directories processed in this run.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+int incremental_open(const char *filename) {
+    struct incremental_header header;
+    struct stat st;
+    size_t nrecords = 0, nnames, offset;
+    int fd;
+
+    incremental.filename = filename;
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1) {
+        if (errno == ENOENT)
+            return 0;
+        ERROR(_("Failed to open index file %s: %s\n"), filename,
+              strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(header)
+        || read_full(fd, &header, sizeof(header))
+        || memcmp(header.magic, INCREMENTAL_MAGIC, sizeof(header.magic)))
+        goto invalid;
+    if (header.uid != owner) {
+        ERROR(_("Index file %s has been created by another user\n"),
+              filename);
+        close(fd);
+        return -1;
+    }
+    if (header.shard_index != shard.index || header.shard_count != shard.count
+        || header.shard_depth != shard.depth) {
+        VERBOSE(_("Index file %s has been created for another shard, it is "
+                  "ignored\n"), filename);
+        close(fd);
+        return 0;
+    }
+    incremental.len = st.st_size - sizeof(header);
+    incremental.data = xmalloc(incremental.len ? incremental.len : 1);
+    if (read_full(fd, incremental.data, incremental.len))
+        goto invalid;
+    close(fd);
+    fd = -1;
+
+    /* check records and count them to size the hash table */
+    for (offset = 0; offset < incremental.len; nrecords++) {
+        struct incremental_record *record;
+
+        if (incremental.len - offset < sizeof(*record))
+            goto invalid;
+        record = (struct incremental_record *) (incremental.data + offset);
+        offset += sizeof(*record);
+        if (incremental.len - offset < INCREMENTAL_ALIGN(record->nameslen)
+            || (record->nameslen
+                && incremental.data[offset + record->nameslen - 1] != '\0'))
+            goto invalid;
+        /*
+         * each subdirectory name is NUL terminated and must be an entry of
+         * the recorded directory, as the index is supplied by the user
+         */
+        nnames = 0;
+        for (uint32_t i = 0; i < record->nameslen;) {
+            const char *name = incremental.data + offset + i;
+            size_t len = strlen(name);
+
+            if (len == 0 || strchr(name, '/') || strcmp(name, ".") == 0
+                || strcmp(name, "..") == 0)
+                goto invalid;
+            i += len + 1;
+            nnames++;
+        }
+        if (nnames != record->nsubdirs)
+            goto invalid;
+        offset += INCREMENTAL_ALIGN(record->nameslen);
+    }
+    incremental.size = 64;
+    while (incremental.size < nrecords * 2)
+        incremental.size *= 2;
+    incremental.slots = xmalloc(incremental.size * sizeof(size_t));
+    memset(incremental.slots, 0, incremental.size * sizeof(size_t));
+    for (offset = 0; offset < incremental.len;) {
+        struct incremental_record *record =
+            (struct incremental_record *) (incremental.data + offset);
+        size_t i = visited_hash(record->dev, record->ino)
+            & (incremental.size - 1);
+
+        while (incremental.slots[i])
+            i = (i + 1) & (incremental.size - 1);
+        incremental.slots[i] = offset + 1;
+        offset += sizeof(*record) + INCREMENTAL_ALIGN(record->nameslen);
+    }
+    return 0;
+
+  invalid:
+    ERROR(_("Invalid index file %s\n"), filename);
+    if (fd != -1)
+        close(fd);
+    free(incremental.data);
+    incremental.data = NULL;
+    incremental.len = 0;
+    return -1;
+}
+
+/*
+ * Returns the record of the directory whose status is st in the index of
+ * previous run, or NULL if it is not recorded or if it has changed since.
+ */
+static const struct incremental_record *incremental_lookup(const struct stat
+                                                          *st) {
+    size_t i;
+
+    if (incremental.slots == NULL)
+        return NULL;
+    for (i = visited_hash(st->st_dev, st->st_ino) & (incremental.size - 1);
+         incremental.slots[i]; i = (i + 1) & (incremental.size - 1)) {
+        const struct incremental_record *record =
+            (struct incremental_record *) (incremental.data
+                                           + incremental.slots[i] - 1);
+
+        if (record->dev != st->st_dev || record->ino != st->st_ino)
+            continue;
+        if (record->mtime_sec != st->st_mtim.tv_sec
+            || record->mtime_nsec != st->st_mtim.tv_nsec
+            || record->ctime_sec != st->st_ctim.tv_sec
+            || record->ctime_nsec != st->st_ctim.tv_nsec)
+            return NULL;
+        return record;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the NUL terminated names of the subdirectories of record.
+ */
+static const char *incremental_names(const struct incremental_record
+                                     *record) {
+    return (const char *) (record + 1);
+}
+
+/*
+ * Record the directory whose status was st when it was opened, with the n
+ * NUL terminated names of its subdirectories of total length len.
+ */
+static void incremental_add(const struct stat *st, const char *names,
+                            size_t len, size_t n) {
+    struct incremental_record record;
+    size_t size = sizeof(record) + INCREMENTAL_ALIGN(len);
+
+    memset(&record, 0, sizeof(record));
+    record.dev = st->st_dev;
+    record.ino = st->st_ino;
+    record.mtime_sec = st->st_mtim.tv_sec;
+    record.mtime_nsec = st->st_mtim.tv_nsec;
+    record.ctime_sec = st->st_ctim.tv_sec;
+    record.ctime_nsec = st->st_ctim.tv_nsec;
+    record.nsubdirs = n;
+    record.nameslen = len;
+
+    pthread_mutex_lock(&incremental.lock);
+    if (incremental.outlen + size > incremental.outsize) {
+        while (incremental.outlen + size > incremental.outsize)
+            incremental.outsize = incremental.outsize
+                ? incremental.outsize * 2 : 65536;
+        incremental.out = xrealloc(incremental.out, incremental.outsize);
+    }
+    memcpy(incremental.out + incremental.outlen, &record, sizeof(record));
+    memcpy(incremental.out + incremental.outlen + sizeof(record), names, len);
+    memset(incremental.out + incremental.outlen + sizeof(record) + len, 0,
+           INCREMENTAL_ALIGN(len) - len);
+    incremental.outlen += size;
+    pthread_mutex_unlock(&incremental.lock);
+}
+
+/*
+ * Replace the index file with the directories recorded in this run.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+int incremental_close(void) {
+    struct incremental_header header;
+    char *tmp;
+    int fd;
+
+    if (incremental.filename == NULL)
+        return 0;
+    if (asprintf(&tmp, "%s.XXXXXX", incremental.filename) == -1) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INCREMENTAL_MAGIC, sizeof(header.magic));
+    header.uid = owner;
+    header.shard_index = shard.index;
+    header.shard_count = shard.count;
+    header.shard_depth = shard.depth;
+    if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1
+        || write_full(fd, &header, sizeof(header))
+        || write_full(fd, incremental.out, incremental.outlen)
+        || fsync(fd) || close(fd) || rename(tmp, incremental.filename)) {
+        ERROR(_("Failed to write index file %s: %s\n"), incremental.filename,
+              strerror(errno));
+        if (fd != -1)
+            unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    free(incremental.data);
+    free(incremental.slots);
+    free(incremental.out);
+    incremental.filename = NULL;
+    return 0;
+}
+
+/**********************************************************
+ *                                                        *
+ *                        Shards                          *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * With --shard i/N, project trees are partitioned between N processes without
+ * coordination. Every entry has a key, the path relative to its project root
+ * truncated to the split depth, and it is processed by the shard whose index
+ * is the hash of this key modulo N. All the entries of a subtree rooted at the
+ * split depth are then processed by the same shard, other shards do not walk
+ * it at all. Directories above the split depth are walked by all shards, to
+ * reach the subtrees they own.
+ *
+ * The hash is FNV-1a of the key, computed incrementally along paths so it
+ * does not depend on the walk nor on the process.
+ */
+
+#define SHARD_HASH_INIT 0xcbf29ce484222325ULL
+#define SHARD_HASH_PRIME 0x100000001b3ULL
+
+/*
+ * Returns the key hash of the entry at relative path (possibly with several
+ * components) under the directory with key hash and depth, the depth of the
+ * entry is stored in depth.
+ */
+uint64_t shard_hash(uint64_t hash, int *depth, const char *path) {
+    while (*path) {
+        if (*path == '/') {
+            path++;
+            continue;
+        }
+        if (++*depth > shard.depth) {
+            /* remaining components are below the split depth */
+            while (*path && *path != '/')
+                path++;
+            continue;
+        }
+        hash = (hash ^ '/') * SHARD_HASH_PRIME;
+        for (; *path && *path != '/'; path++)
+            hash = (hash ^ (unsigned char) *path) * SHARD_HASH_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Returns the key hash of the canonical path in project_root, its depth
+ * under project root is stored in depth.
+ */
+uint64_t shard_path_hash(const char *path, const char *project_root,
+                         int *depth) {
+    *depth = 0;
+    return shard_hash(SHARD_HASH_INIT, depth, path + strlen(project_root));
+}
+
+static inline bool shard_owns(uint64_t hash) {
+    return shard.count == 1 || hash % shard.count == (uint64_t) shard.index;
+}
+
+/*
+ * Parse shard specification i/N given in spec.
+ *
+ * Returns 0 on success, -1 if spec is invalid.
+ */
+int shard_parse(const char *spec) {
+    char *end;
+    long index, count;
+
+    errno = 0;
+    index = strtol(spec, &end, 10);
+    if (errno || end == spec || *end != '/')
+        return -1;
+    spec = end + 1;
+    count = strtol(spec, &end, 10);
+    if (errno || end == spec || *end != '\0' || count < 1
+        || count > INT_MAX || index < 0 || index >= count)
+        return -1;
+    shard.index = index;
+    shard.count = count;
+    return 0;
+}
+
+/**********************************************************
+ *                                                        *
+ *             Workflow processing functions              *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * Get identity, type, mode, owner and links count of entry name relative to
+ * directory file descriptor dirfd, without following symlinks. This is done
+ * with a single statx() call restricted to these fields, or with fstatat()
+ * when statx() is not supported by the running kernel.
+ *
+ * Returns 0 on success, -1 otherwise with errno set.
+ */
+int get_entry_stat(int dirfd, const char *name, struct entry_stat *est) {
+    static atomic_bool no_statx = false;
+    struct statx stx;
+    struct stat st;
+    unsigned long long start, latency;
+    int rc;
+
+    governor_op();
+    start = stats_begin();
+    latency = governor_begin();
+    if (!atomic_load_explicit(&no_statx, memory_order_relaxed)) {
+        rc = statx(dirfd, name, AT_SYMLINK_NOFOLLOW,
+                   STATX_TYPE | STATX_MODE | STATX_UID | STATX_INO |
+                   STATX_NLINK, &stx);
+        stats_end(STATS_STAT, start);
+        governor_end(latency);
+        if (rc == 0) {
+            est->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            est->ino = stx.stx_ino;
+            est->mode = stx.stx_mode;
+            est->uid = stx.stx_uid;
+            est->nlink = stx.stx_nlink;
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        atomic_store(&no_statx, true);
+        start = stats_begin();
+    }
+    rc = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+    stats_end(STATS_STAT, start);
+    governor_end(latency);
+    if (rc)
+        return -1;
+    est->dev = st.st_dev;
+    est->ino = st.st_ino;
+    est->mode = st.st_mode;
+    est->uid = st.st_uid;
+    est->nlink = st.st_nlink;
+    return 0;
+}
+
+/*
+ * Set user as the owner of the entry name relative to directory file
+ * descriptor dirfd, whose status est has just been retrieved, and ensure group
+ * owner has rw permissions. The owner and the mode are changed only if
+ * required. The path of the entry is used in messages, it may be NULL when
+ * not verbose. Status of the entry after modification is stored in est.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+int changeOwner(int dirfd, const char *name, const char *path,
+                struct entry_stat *est) {
+    bool compliant = true;
+    int ret;
+    unsigned long long start, latency;
+
+    //use lchown to change owner for symlinks
+    if (est->uid != owner) {
+        VERBOSE(_("Changing owner of path %s\n"), path);
+        governor_op();
+        PROBE(chown__start, dirfd, name, owner);
+        latency = governor_begin();
+        start = stats_begin();
+        ret = fchownat(dirfd, name, owner, (gid_t) - 1, AT_SYMLINK_NOFOLLOW);
+        stats_end(STATS_CHOWN, start);
+        governor_end(latency);
+        PROBE(chown__done, dirfd, name, ret);
+        if (ret) {
+            PERROR(_("Error on chown(): "));
+            return -1;
+        }
+        atomic_fetch_add_explicit(&counters.chowned, 1,
+                                  memory_order_relaxed);
+        compliant = false;
+        est->uid = owner;
+        // chown() may clear setuid and setgid bits, get the new mode
+        if ((est->mode & (S_ISUID | S_ISGID))
+            && get_entry_stat(dirfd, name, est)) {
+            PERROR(_("Error on lstat()"));
+            return -1;
+        }
+    }
+    //set rw to group if its not a symlink
+    if (!S_ISLNK(est->mode)
+        && (est->mode & (S_IRGRP | S_IWGRP)) != (S_IRGRP | S_IWGRP)) {
+        VERBOSE(_("Ensuring group owner has rw permissions on path %s\n"),
+                path);
+
+        governor_op();
+        PROBE(chmod__start, dirfd, name, S_IRGRP | S_IWGRP | est->mode);
+        latency = governor_begin();
+        start = stats_begin();
+        ret = fchmodat(dirfd, name, S_IRGRP | S_IWGRP | est->mode, 0);
+        stats_end(STATS_CHMOD, start);
+        governor_end(latency);
+        PROBE(chmod__done, dirfd, name, ret);
+        if (ret != 0) {
+            PERROR(_("Error on chmod(): "));
+            return -1;
+        }
+        atomic_fetch_add_explicit(&counters.chmoded, 1,
+                                  memory_order_relaxed);
+        compliant = false;
+        est->mode |= S_IRGRP | S_IWGRP;
+    }
+    if (compliant)
+        atomic_fetch_add_explicit(&counters.compliant, 1,
+                                  memory_order_relaxed);
+    return 0;
+}
+
+/* callback of the library walk, called with the result of setOwner() */
+static prown_walk_cb walk_callback;
+static void *walk_callback_arg;
+
+/*
+ * Report to the callback of the library walk the action performed by
+ * setOwner() on the entry at path, with its status old before processing and
+ * new after processing, and errno error on failure.
+ *
+ * Returns the value returned by the callback, non-zero to abort the walk.
+ */
+static int walk_callback_entry(const char *path, const struct entry_stat *old,
+                               const struct entry_stat *new,
+                               enum prown_action action, int error) {
+    struct prown_entry entry = {
+        .path = path,
+        .dev = old->dev,
+        .ino = old->ino,
+        .old_uid = old->uid,
+        .old_mode = old->mode,
+        .new_uid = new->uid,
+        .new_mode = new->mode,
+        .action = action,
+        .error = error
+    };
+
+    return walk_callback(&entry, walk_callback_arg);
+}
+
+/*
+ * set user as the owner of the entry name relative to directory file
+ * descriptor dirfd, dir is the walker task of this directory (or NULL if name
+ * is a full path) used to build the path in messages. Status of the entry
+ * after modification is stored in est.
+ *
+ * The entry is stat'ed once, the owner and the mode are then changed only if
+ * required. With AIMD, the thread waits for the governor to let it process an
+ * entry. When a plan is written, the entry is only recorded in the plan,
+ * otherwise the changes are recorded in the journal if enabled. Entries
+ * already processed through another hard link, directories already being
+ * walked and, with --one-file-system, entries on another filesystem than dir
+ * are skipped. With --shard, entries of other shards are skipped,
+ * except directories above the split depth which are walked unmodified.
+ * Changes and failures are written in structured output if enabled. The
+ * result is finally reported to the callback of the library walk, if any.
+ *
+ * Returns 0 on success, 1 if the entry is skipped and must not be walked, -1
+ * if an error has been reported or if the callback aborts the walk.
+ * */
+int setOwner(int dirfd, const char *name, const struct walk_task *dir,
+             struct entry_stat *est) {
+    char *path = verbose || walk_callback ? walk_path(dir, name) : NULL;
+    struct entry_stat old;
+    enum prown_action action = PROWN_FAILED;
+    int rc = -1, error = 0;
+
+    memset(&old, 0, sizeof(old));
+    governor_enter();
+    if (get_entry_stat(dirfd, name, est)) {
+        error = errno;
+        PERROR(_("Error on lstat()"));
+        *est = old;
+        goto end;
+    }
+    old = *est;
+    action = PROWN_SKIPPED;
+    rc = 1;
+    if (one_file_system && dir && est->dev != walk_task_dev(dir)) {
+        VERBOSE(_("Skipping path %s on another filesystem\n"), path);
+        goto end;
+    }
+    if (S_ISDIR(est->mode) && dir && walk_loop(dir, name, est))
+        goto end;
+    if (dir && shard.count > 1 && !walk_shard_owns(dir, name)) {
+        rc = S_ISDIR(est->mode) ? 0 : 1;
+        goto end;
+    }
+    if (!S_ISDIR(est->mode) && est->nlink > 1 && !visited_add(est)) {
+        VERBOSE(_("Skipping path %s, hard link of an entry already "
+                  "processed\n"), path);
+        atomic_fetch_add_explicit(&counters.hardlinks, 1,
+                                  memory_order_relaxed);
+        goto end;
+    }
+    atomic_fetch_add_explicit(&counters.entries, 1, memory_order_relaxed);
+
+    if (plan.fp) {
+        rc = plan_entry(dir, name, path, est);
+    } else {
+        rc = changeOwner(dirfd, name, path, est);
+        error = rc ? errno : 0;
+        if (journal.fd != -1
+            && (old.uid != est->uid || old.mode != est->mode))
+            journal_change(dir, name, path, &old, est);
+    }
+    if (rc)
+        action = PROWN_FAILED;
+    else if (old.uid != est->uid || old.mode != est->mode)
+        action = PROWN_CHANGED;
+    else
+        action = PROWN_COMPLIANT;
+  end:
+    governor_exit();
+    if (output.enabled && (action == PROWN_CHANGED || action == PROWN_FAILED))
+        output_entry(dir, name, path, &old, est, error);
+    if (walk_callback && walk_callback_entry(path, &old, est, action, error))
+        rc = -1;
+    free(path);
+    return rc;
+}
+
+/**********************************************************
+ *                                                        *
+ *                  Parallel tree walker                  *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * Directories are walked by a pool of worker threads. Each worker owns a
+ * deque of pending directories: it pushes and pops subdirectories at the tail
+ * of its own deque (depth-first, like the former recursive walk) while idle
+ * workers steal the oldest directories at the head of the other deques.
+ *
+ * Large directories are read in big getdents64() batches. While the worker
+ * reading such a directory is busy, batches of entries are handed over to
+ * idle workers as chunk tasks, so the entries of a single huge directory are
+ * processed in parallel while the next batch is read.
+ *
+ * In verbose mode, messages are not printed directly by the workers but
+ * recorded in a report attached to each directory. A directory report is a
+ * sequence of messages and links to the reports of its subdirectories, at the
+ * position where the recursive walk would have printed them. Reports are
+ * flushed in this order as soon as directories are completed, so the output
+ * does not depend on the number of workers nor on threads scheduling.
+ */
+
+struct report;
+
+struct report_item {
+    char *text;                 /* messages, NULL for subdirectory link */
+    size_t len;
+    size_t size;
+    struct report *child;       /* subdirectory report */
+};
+
+struct report {
+    struct report *parent;
+    struct report_item *items;
+    size_t nitems;
+    size_t size;
+    size_t pos;                 /* next item to flush */
+    bool done;                  /* directory processing is over */
+};
+
+/*
+ * Directory to walk. Directories are opened relative to the file descriptor
+ * of their parent, which is kept open as long as some subdirectories have not
+ * been opened yet. Tasks keep a reference on their parent so paths can be
+ * built for messages.
+ */
+struct walk_task {
+    struct walk_task *parent;
+    struct walk_batch *batch;   /* allocation block, NULL if allocated alone */
+    atomic_int refs;            /* task and its subdirectories tasks */
+    atomic_int fdrefs;          /* task and subdirectories not opened yet */
+    int fd;
+    dev_t dev;                  /* identity of the directory, ino is 0 */
+    ino_t ino;                  /* until it is known */
+    struct report *report;
+    uint64_t shard_hash;        /* key hash and depth under project root */
+    int depth;
+    int level;                  /* depth under walk root */
+    char *dents;                /* for chunk tasks, entries of the parent */
+    size_t dentslen;            /* directory to process, NULL otherwise */
+    char name[];                /* full path for the walk root */
+};
+
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_task **tasks;   /* pending tasks are in [head, tail[ */
+    size_t head;
+    size_t tail;
+    size_t size;
+};
+
+struct walk_pool {
+    int nworkers;
+    struct walk_deque *deques;
+    atomic_size_t pending;      /* tasks pushed and not completed yet */
+    atomic_size_t queued;       /* tasks waiting in deques */
+    atomic_int idle;            /* workers waiting for tasks */
+    atomic_bool abort;          /* stop walking after fatal error */
+    atomic_int status;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_mutex_t report_lock;
+    struct report *flushed;     /* report currently being flushed */
+    const char *root;           /* path of walk root directory */
+    struct walk_task **current; /* task processed by each worker */
+    pthread_rwlock_t snapshot_lock;
+    atomic_llong next_checkpoint;
+};
+
+static struct walk_pool pool;
+
+/* directories file descriptors opened by walkers and kept for subdirectories */
+static atomic_int walk_open_fds;
+
+/*
+ * Subdirectories tasks found in a directory are allocated in a single batch,
+ * with their names. The batch is freed when all its tasks are released.
+ */
+struct walk_batch {
+    atomic_size_t refs;         /* tasks not released yet */
+};
+
+#define WALK_ALIGN(size) \
+        (((size) + _Alignof(struct walk_task) - 1) \
+         & ~(_Alignof(struct walk_task) - 1))
+
+/*
+ * Subdirectories found by a worker in the directory it walks, collected
+ * before their batch is allocated. Buffers are reused for all the
+ * directories walked by the worker.
+ */
+struct walk_subdir {
+    size_t name;                /* offset of name in names arena */
+    dev_t dev;
+    ino_t ino;
+    struct report *report;
+    struct walk_task *task;
+};
+
+/*
+ * Entry read in the directory walked by a worker, waiting to be processed in
+ * inode order.
+ */
+struct walk_entry {
+    ino_t ino;
+    size_t name;                /* offset of name in entries names arena */
+};
+
+/* maximum number of entries sorted together in inode order */
+#define WALK_BATCH 65536
+
+/*
+ * Size of the buffer of directories entries read at once, and minimum size
+ * of entries read to be handed over to another worker.
+ */
+#define WALK_DENTS_SIZE (256 * 1024)
+#define WALK_CHUNK_MIN  (64 * 1024)
+
+/* directory entry returned by getdents64() */
+struct walk_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static __thread struct {
+    char *dents;                /* entries read with getdents64() */
+    char *names;                /* arena of NUL terminated names */
+    size_t len;
+    size_t size;
+    struct walk_subdir *subdirs;
+    size_t nsubdirs;
+    size_t nsize;
+    char *entries_names;        /* arena of entries names */
+    size_t entries_len;
+    size_t entries_size;
+    struct walk_entry *entries;
+    size_t nentries;
+    size_t esize;
+    bool partial;               /* entries of directory pruned or skipped */
+} scratch;
+
+/* index of the current worker in pool and report of its current task */
+static __thread int worker_id;
+static __thread struct report *current_report;
+
+/*
+ * Returns a new item at the end of report items.
+ */
+static struct report_item *report_new_item(struct report *report) {
+    struct report_item *item;
+
+    if (report->nitems == report->size) {
+        report->size = report->size ? report->size * 2 : 4;
+        report->items = xrealloc(report->items,
+                                 report->size * sizeof(struct report_item));
+    }
+    item = &report->items[report->nitems++];
+    memset(item, 0, sizeof(struct report_item));
+    return item;
+}
+
+static struct report *report_new(struct report *parent) {
+    struct report *report = xmalloc(sizeof(struct report));
+
+    memset(report, 0, sizeof(struct report));
+    report->parent = parent;
+    if (parent)
+        report_new_item(parent)->child = report;
+    return report;
+}
+
+/*
+ * Print formatted message on stdout, or record it in the report of the
+ * current walker task if any.
+ */
+void report_printf(const char *fmt, ...) {
+    struct report *report = current_report;
+    struct report_item *item;
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    if (report == NULL) {
+        vprintf(fmt, ap);
+        va_end(ap);
+        return;
+    }
+    len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+
+    /* append to the last messages item if possible */
+    if (report->nitems && report->items[report->nitems - 1].child == NULL)
+        item = &report->items[report->nitems - 1];
+    else
+        item = report_new_item(report);
+
+    if (item->len + len + 1 > item->size) {
+        item->size = (item->len + len + 1) * 2;
+        item->text = xrealloc(item->text, item->size);
+    }
+    va_start(ap, fmt);
+    vsnprintf(item->text + item->len, len + 1, fmt, ap);
+    va_end(ap);
+    item->len += len;
+}
+
+/*
+ * Print all messages of completed reports in walk order, starting from the
+ * report currently being flushed, and release them. Must be called with
+ * pool.report_lock held.
+ */
+static void report_flush(void) {
+    struct report *report = pool.flushed;
+
+    while (report && report->done) {
+        if (report->pos == report->nitems) {
+            struct report *parent = report->parent;
+
+            free(report->items);
+            free(report);
+            report = parent;
+            continue;
+        }
+        struct report_item *item = &report->items[report->pos++];
+
+        if (item->child) {
+            report = item->child;
+        } else {
+            fwrite(item->text, 1, item->len, stdout);
+            free(item->text);
+        }
+    }
+    pool.flushed = report;
+}
+
+static struct walk_task *walk_task_new(struct walk_task *parent,
+                                       const char *name) {
+    size_t len = strlen(name) + 1;
+    struct walk_task *task = xmalloc(sizeof(struct walk_task) + len);
+
+    task->parent = parent;
+    task->batch = NULL;
+    atomic_init(&task->refs, 1);
+    atomic_init(&task->fdrefs, 1);
+    task->fd = -1;
+    task->dev = 0;
+    task->ino = 0;
+    task->report = verbose ? report_new(parent ? parent->report : NULL) : NULL;
+    task->shard_hash = SHARD_HASH_INIT;
+    task->depth = 0;
+    task->level = 0;
+    task->dents = NULL;
+    task->dentslen = 0;
+    memcpy(task->name, name, len);
+    if (parent) {
+        atomic_fetch_add(&parent->refs, 1);
+        atomic_fetch_add(&parent->fdrefs, 1);
+        task->depth = parent->depth;
+        task->shard_hash = shard_hash(parent->shard_hash, &task->depth, name);
+        task->level = parent->level + task->depth - parent->depth;
+    }
+    return task;
+}
+
+/*
+ * Allocate the task of the walk root path in project_root.
+ */
+static struct walk_task *walk_root_new(const char *path,
+                                       const char *project_root) {
+    struct walk_task *task = walk_task_new(NULL, path);
+
+    task->shard_hash = shard_path_hash(path, project_root, &task->depth);
+    return task;
+}
+
+/*
+ * Allocate in a single batch the tasks of the subdirectories of parent
+ * collected in worker scratch buffers, tasks are stored in the subdirs items.
+ */
+static void walk_batch_new(struct walk_task *parent) {
+    size_t size = WALK_ALIGN(sizeof(struct walk_batch));
+    size_t n = scratch.nsubdirs;
+    struct walk_batch *batch;
+    char *ptr;
+
+    for (size_t i = 0; i < n; i++) {
+        size_t end = i + 1 < n ? scratch.subdirs[i + 1].name : scratch.len;
+
+        size += WALK_ALIGN(sizeof(struct walk_task) + end
+                           - scratch.subdirs[i].name);
+    }
+    batch = xmalloc(size);
+    atomic_init(&batch->refs, n);
+    ptr = (char *) batch + WALK_ALIGN(sizeof(struct walk_batch));
+    for (size_t i = 0; i < n; i++) {
+        struct walk_subdir *subdir = &scratch.subdirs[i];
+        struct walk_task *task = (struct walk_task *) ptr;
+        size_t end = i + 1 < n ? scratch.subdirs[i + 1].name : scratch.len;
+
+        task->parent = parent;
+        task->batch = batch;
+        atomic_init(&task->refs, 1);
+        atomic_init(&task->fdrefs, 1);
+        task->fd = -1;
+        task->dev = subdir->dev;
+        task->ino = subdir->ino;
+        task->report = subdir->report;
+        task->depth = parent->depth;
+        task->shard_hash = shard_hash(parent->shard_hash, &task->depth,
+                                      scratch.names + subdir->name);
+        task->level = parent->level + 1;
+        task->dents = NULL;
+        task->dentslen = 0;
+        memcpy(task->name, scratch.names + subdir->name, end - subdir->name);
+        subdir->task = task;
+        ptr += WALK_ALIGN(sizeof(struct walk_task) + end - subdir->name);
+    }
+    atomic_fetch_add(&parent->refs, n);
+    atomic_fetch_add(&parent->fdrefs, n);
+}
+
+/*
+ * Release a reference on task file descriptor, closing it when it is not
+ * needed anymore by the task nor by its subdirectories.
+ */
+static void walk_fd_release(struct walk_task *task) {
+    if (atomic_fetch_sub(&task->fdrefs, 1) == 1 && task->fd != -1) {
+        close(task->fd);
+        task->fd = -1;
+        atomic_fetch_sub(&walk_open_fds, 1);
+    }
+}
+
+/*
+ * Take a reference on task file descriptor if it is still open.
+ *
+ * Returns true if the reference is taken, false otherwise.
+ */
+static bool walk_fd_hold(struct walk_task *task) {
+    int refs = atomic_load(&task->fdrefs);
+
+    do {
+        if (refs == 0)
+            return false;
+    } while (!atomic_compare_exchange_weak(&task->fdrefs, &refs, refs + 1));
+    if (task->fd == -1) {
+        walk_fd_release(task);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Release a reference on task, freeing it and its parents when they are not
+ * used anymore.
+ */
+static void walk_task_release(struct walk_task *task) {
+    while (task && atomic_fetch_sub(&task->refs, 1) == 1) {
+        struct walk_task *parent = task->parent;
+
+        free(task->dents);
+        if (task->batch == NULL)
+            free(task);
+        else if (atomic_fetch_sub(&task->batch->refs, 1) == 1)
+            free(task->batch);
+        task = parent;
+    }
+}
+
+/*
+ * Returns newly allocated path of entry name in directory dir, or name if dir
+ * is NULL.
+ */
+char *walk_path(const struct walk_task *dir, const char *name) {
+    size_t len = strlen(name) + 1;
+    char *path, *end;
+
+    for (const struct walk_task * task = dir; task; task = task->parent)
+        len += strlen(task->name) + 1;
+    path = xmalloc(len);
+    end = path + len - 1;
+    *end = '\0';
+    for (;;) {
+        size_t l = strlen(name);
+
+        end -= l;
+        memcpy(end, name, l);
+        if (dir == NULL)
+            break;
+        *--end = '/';
+        name = dir->name;
+        dir = dir->parent;
+    }
+    return path;
+}
+
+/*
+ * Get the identity of the opened directory of task if it has not been
+ * retrieved when its parent was walked (ie. roots of walks).
+ */
+static void walk_task_stat(struct walk_task *task) {
+    struct stat st;
+
+    if (task->fd == -1 || task->ino || fstat(task->fd, &st))
+        return;
+    task->dev = st.st_dev;
+    task->ino = st.st_ino;
+}
+
+/*
+ * Returns the device of the opened directory of task.
+ */
+dev_t walk_task_dev(const struct walk_task *task) {
+    return task->dev;
+}
+
+/*
+ * Check whether the directory name in dir, with status est, is dir itself or
+ * one of its ancestors. Hard links to directories are not allowed but bind
+ * mounts can make a directory appear in its own subtree.
+ *
+ * Returns true if the loop has been reported, false otherwise.
+ */
+bool walk_loop(const struct walk_task *dir, const char *name,
+               const struct entry_stat *est) {
+    const struct walk_task *task;
+    char *path, *ancestor;
+
+    for (task = dir; task; task = task->parent)
+        if (task->ino == est->ino && task->dev == est->dev)
+            break;
+    if (task == NULL)
+        return false;
+
+    path = walk_path(dir, name);
+    ancestor = walk_path(task->parent, task->name);
+    ERROR(_("Filesystem loop detected, directory %s is the same as %s, it "
+            "is skipped\n"), path, ancestor);
+    free(path);
+    free(ancestor);
+    STATS_INC(errors);
+    atomic_store(&pool.status, 1);
+    return true;
+}
+
+/*
+ * Push task at the tail of current worker deque and wake up an idle worker
+ * to steal it.
+ */
+static void walk_push(struct walk_task *task) {
+    struct walk_deque *deque = &pool.deques[worker_id];
+
+    atomic_fetch_add(&pool.pending, 1);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->size) {
+        if (deque->head > 0) {
+            memmove(deque->tasks, deque->tasks + deque->head,
+                    (deque->tail - deque->head) * sizeof(struct walk_task *));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            deque->size = deque->size ? deque->size * 2 : 64;
+            deque->tasks = xrealloc(deque->tasks,
+                                    deque->size *
+                                    sizeof(struct walk_task *));
+        }
+    }
+    deque->tasks[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+
+    atomic_fetch_add(&pool.queued, 1);
+    if (atomic_load(&pool.idle) > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_signal(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/*
+ * Pop the most recent task of deque of worker id if own is true, or steal its
+ * oldest task otherwise. Returns NULL if the deque is empty.
+ */
+static struct walk_task *walk_take(int id, bool own) {
+    struct walk_deque *deque = &pool.deques[id];
+    struct walk_task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        if (own)
+            task = deque->tasks[--deque->tail];
+        else
+            task = deque->tasks[deque->head++];
+        if (deque->head == deque->tail)
+            deque->head = deque->tail = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    if (task)
+        atomic_fetch_sub(&pool.queued, 1);
+    return task;
+}
+
+static struct walk_task *walk_next(void) {
+    struct walk_task *task;
+
+    /* tasks must always be in a deque or current for checkpoints */
+    if (checkpoint_file)
+        pthread_rwlock_rdlock(&pool.snapshot_lock);
+    task = walk_take(worker_id, true);
+    for (int i = 1; task == NULL && i < pool.nworkers; i++)
+        task = walk_take((worker_id + i) % pool.nworkers, false);
+    if (checkpoint_file) {
+        pool.current[worker_id] = task;
+        pthread_rwlock_unlock(&pool.snapshot_lock);
+    }
+    return task;
+}
+
+static void walk_fail(void) {
+    atomic_store(&pool.status, 1);
+    atomic_store(&pool.abort, true);
+    pthread_mutex_lock(&pool.lock);
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+ * Open directory path relative to directory file descriptor dirfd without
+ * following symlinks nor going up in the tree. The path is resolved with
+ * openat2() in chunks shorter than PATH_MAX, or component by component when
+ * openat2() is not supported by the running kernel.
+ *
+ * Returns the new file descriptor, or -1 with errno set on error.
+ */
+static int open_beneath(int dirfd, const char *path) {
+    static atomic_bool no_openat2 = false;
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    struct open_how how = {
+        .flags = flags,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS |
+            RESOLVE_NO_MAGICLINKS,
+    };
+    char *dup = strdup(path), *saveptr, *name, *chunk, *end;
+    int fd = dirfd, nfd, err = EINVAL;
+
+    if (dup == NULL)
+        return -1;
+    for (name = dup; *name; name += strcspn(name, "/")) {
+        size_t len;
+
+        name += strspn(name, "/");
+        len = strcspn(name, "/");
+        if ((len == 1 && name[0] == '.')
+            || (len == 2 && name[0] == '.' && name[1] == '.'))
+            goto fail;
+    }
+
+    for (chunk = dup; !atomic_load_explicit(&no_openat2,
+                                            memory_order_relaxed)
+         && *(chunk += strspn(chunk, "/")); chunk = end) {
+        size_t len = strlen(chunk);
+
+        if (len >= PATH_MAX) {
+            len = PATH_MAX - 1;
+            while (len && chunk[len] != '/')
+                len--;
+            if (len == 0) {
+                err = ENAMETOOLONG;
+                goto fail;
+            }
+        }
+        end = chunk + len;
+        if (*end)
+            *end++ = '\0';
+        nfd = syscall(SYS_openat2, fd, chunk, &how, sizeof(how));
+        err = errno;
+        /* resolution may also fail on concurrent renames, retry slowly */
+        if (nfd == -1 && (err == ENOSYS || err == EAGAIN)) {
+            if (err == ENOSYS)
+                atomic_store(&no_openat2, true);
+            if (fd != dirfd)
+                close(fd);
+            fd = dirfd;
+            break;
+        }
+        if (fd != dirfd)
+            close(fd);
+        fd = nfd;
+        if (fd == -1)
+            goto fail;
+    }
+    if (fd != dirfd) {
+        free(dup);
+        return fd;
+    }
+
+    /* component by component */
+    strcpy(dup, path);
+    for (name = strtok_r(dup, "/", &saveptr); name;
+         name = strtok_r(NULL, "/", &saveptr)) {
+        nfd = openat(fd, name, flags);
+        err = errno;
+        if (fd != dirfd)
+            close(fd);
+        fd = nfd;
+        if (fd == -1)
+            goto fail;
+    }
+    free(dup);
+    if (fd == dirfd) {
+        errno = EINVAL;
+        return -1;
+    }
+    return fd;
+  fail:
+    if (fd != dirfd && fd != -1)
+        close(fd);
+    free(dup);
+    errno = err;
+    return -1;
+}
+
+/*
+ * Open the directory of task when its parent file descriptor has been closed
+ * to stay in the budget of open file descriptors. The directory is opened
+ * relative to its nearest ancestor still open, or else to the walk root, and
+ * its identity is checked against the one found when its parent was walked.
+ *
+ * Returns the file descriptor, -1 on error with errno set.
+ */
+static int walk_reopen(struct walk_task *task) {
+    struct walk_task *ancestor = task->parent, *t;
+    bool held = false;
+    struct stat st;
+    char *path, *end;
+    size_t len;
+    int dirfd, fd, err;
+
+    STATS_INC(reopened);
+    for (;;) {
+        if ((held = walk_fd_hold(ancestor))) {
+            dirfd = ancestor->fd;
+            break;
+        }
+        if (ancestor->parent == NULL) {
+            dirfd = open(ancestor->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                         | O_CLOEXEC);
+            if (dirfd == -1)
+                return -1;
+            break;
+        }
+        ancestor = ancestor->parent;
+    }
+
+    /* path of task relative to ancestor */
+    len = strlen(task->name) + 1;
+    for (t = task->parent; t != ancestor; t = t->parent)
+        len += strlen(t->name) + 1;
+    path = xmalloc(len);
+    end = path + len - 1;
+    *end = '\0';
+    for (t = task; t != ancestor; t = t->parent) {
+        size_t l = strlen(t->name);
+
+        end -= l;
+        memcpy(end, t->name, l);
+        if (end > path)
+            *--end = '/';
+    }
+    fd = open_beneath(dirfd, path);
+    err = errno;
+    free(path);
+    if (held)
+        walk_fd_release(ancestor);
+    else
+        close(dirfd);
+
+    if (fd == -1) {
+        errno = err;
+        return -1;
+    }
+    if (task->ino && (fstat(fd, &st) || st.st_dev != task->dev
+                      || st.st_ino != task->ino)) {
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Open the directory of the task relative to its parent file descriptor.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int walk_open(struct walk_task *task) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    unsigned long long start;
+
+    governor_op();
+    start = stats_begin();
+    if (task->parent) {
+        if (task->parent->fd == -1)
+            task->fd = walk_reopen(task);
+        else if (strchr(task->name, '/'))
+            task->fd = open_beneath(task->parent->fd, task->name);
+        else
+            task->fd = openat(task->parent->fd, task->name, flags);
+        walk_fd_release(task->parent);
+    } else {
+        task->fd = open(task->name, flags);
+    }
+
+    stats_end(STATS_OPENDIR, start);
+    if (task->fd != -1)
+        atomic_fetch_add(&walk_open_fds, 1);
+    walk_task_stat(task);
+
+    if (task->fd == -1) {
+        char *path = walk_path(task->parent, task->name);
+
+        ERROR(_("Failed to open directory '%s': %s (%d)\n"), path,
+              strerror(errno), errno);
+        free(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Collect subdirectory name with status est in worker scratch buffers, its
+ * report is created in the current report at this point to keep messages
+ * order.
+ */
+static void walk_subdir_add(const char *name, const struct entry_stat *est) {
+    size_t len = strlen(name) + 1;
+    struct walk_subdir *subdir;
+
+    if (scratch.len + len > scratch.size) {
+        while (scratch.len + len > scratch.size)
+            scratch.size = scratch.size ? scratch.size * 2 : 4096;
+        scratch.names = xrealloc(scratch.names, scratch.size);
+    }
+    if (scratch.nsubdirs == scratch.nsize) {
+        scratch.nsize = scratch.nsize ? scratch.nsize * 2 : 64;
+        scratch.subdirs = xrealloc(scratch.subdirs,
+                                   scratch.nsize * sizeof(struct walk_subdir));
+    }
+    subdir = &scratch.subdirs[scratch.nsubdirs++];
+    subdir->name = scratch.len;
+    subdir->dev = est->dev;
+    subdir->ino = est->ino;
+    subdir->report = verbose ? report_new(current_report) : NULL;
+    memcpy(scratch.names + scratch.len, name, len);
+    scratch.len += len;
+}
+
+/*
+ * Returns true if the entry name in directory of task dir belongs to this
+ * shard.
+ */
+bool walk_shard_owns(const struct walk_task *dir, const char *name) {
+    int depth = dir->depth;
+
+    return shard_owns(shard_hash(dir->shard_hash, &depth, name));
+}
+
+/*
+ * Count entry name of directory dir as pruned, with message format.
+ */
+static void walk_prune(const struct walk_task *dir, const char *name,
+                       const char *format) {
+    atomic_fetch_add_explicit(&counters.pruned, 1, memory_order_relaxed);
+    scratch.partial = true;
+    if (verbose) {
+        char *path = walk_path(dir, name);
+
+        VERBOSE(format, path);
+        free(path);
+    }
+}
+
+/*
+ * Set the user as the owner of the entry name of the directory of task, a
+ * subdirectory is collected to be walked. Excluded entries and entries at
+ * split depth of other shards are skipped without being stat'ed.
+ * Subdirectories at maximum depth are not walked. The directory of task is
+ * marked partial when an entry is pruned or a subdirectory is skipped.
+ *
+ * Returns 0 on success, -1 if the walk must be aborted.
+ */
+static int walk_entry(struct walk_task *task, const char *name) {
+    struct entry_stat est;
+    int ret;
+
+    if (exclude_match(name)) {
+        walk_prune(task, name, _("Excluding path %s\n"));
+        return 0;
+    }
+    if (shard.count > 1 && task->depth + 1 >= shard.depth
+        && !walk_shard_owns(task, name))
+        return 0;
+    ret = setOwner(task->fd, name, task, &est);
+
+    if (ret < 0) {
+        STATS_INC(errors);
+        walk_fail();
+        return -1;
+    }
+    if (ret == 1 && S_ISDIR(est.mode))
+        scratch.partial = true;
+    if (ret == 0 && S_ISDIR(est.mode)) {
+        if (max_depth >= 0 && task->level + 1 >= max_depth)
+            walk_prune(task, name, _("Not walking directory %s beyond "
+                                     "maximum depth\n"));
+        else
+            walk_subdir_add(name, &est);
+    }
+    return 0;
+}
+
+/*
+ * Keep directory entry dp in worker scratch buffers to process it later in
+ * inode order.
+ */
+static void walk_entry_add(const struct walk_dirent64 *dp) {
+    size_t len = strlen(dp->d_name) + 1;
+    struct walk_entry *entry;
+
+    if (scratch.entries_len + len > scratch.entries_size) {
+        while (scratch.entries_len + len > scratch.entries_size)
+            scratch.entries_size = scratch.entries_size
+                ? scratch.entries_size * 2 : 4096;
+        scratch.entries_names = xrealloc(scratch.entries_names,
+                                         scratch.entries_size);
+    }
+    if (scratch.nentries == scratch.esize) {
+        scratch.esize = scratch.esize ? scratch.esize * 2 : 256;
+        scratch.entries = xrealloc(scratch.entries,
+                                   scratch.esize * sizeof(struct walk_entry));
+    }
+    entry = &scratch.entries[scratch.nentries++];
+    entry->ino = dp->d_ino;
+    entry->name = scratch.entries_len;
+    memcpy(scratch.entries_names + scratch.entries_len, dp->d_name, len);
+    scratch.entries_len += len;
+}
+
+static int cmp_walk_entry(const void *a, const void *b) {
+    const struct walk_entry *ea = a, *eb = b;
+
+    return (ea->ino > eb->ino) - (ea->ino < eb->ino);
+}
+
+/*
+ * Process the entries kept in worker scratch buffers sorted by inode number,
+ * so their inodes are read in the order of the inodes table.
+ *
+ * Returns 0 on success, -1 if the walk must be aborted.
+ */
+static int walk_entries(struct walk_task *task) {
+    size_t n = scratch.nentries;
+
+    scratch.nentries = 0;
+    scratch.entries_len = 0;
+    qsort(scratch.entries, n, sizeof(struct walk_entry), cmp_walk_entry);
+    for (size_t i = 0; i < n && !atomic_load(&pool.abort); i++) {
+        if (walk_entry(task, scratch.entries_names
+                       + scratch.entries[i].name))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Process only the subdirectories of the directory of the task recorded in
+ * the index, its other entries have not changed since previous run.
+ *
+ * Returns 0 on success, -1 if the walk must be aborted.
+ */
+static int walk_unchanged(struct walk_task *task,
+                          const struct incremental_record *record) {
+    const char *name = incremental_names(record);
+
+    atomic_fetch_add_explicit(&counters.unchanged, 1, memory_order_relaxed);
+    for (uint32_t i = 0; i < record->nsubdirs; i++) {
+        if (atomic_load(&pool.abort) || walk_entry(task, name))
+            return -1;
+        name += strlen(name) + 1;
+    }
+    return 0;
+}
+
+/*
+ * Process the entries read with getdents64() in buffer dents of len bytes,
+ * in the directory of task. The number of entries is added to count.
+ *
+ * Returns 0 on success, -1 if the walk must be aborted.
+ */
+static int walk_dents(struct walk_task *task, const char *dents, size_t len,
+                      size_t *count) {
+    const struct walk_dirent64 *dp;
+    int ret = 0;
+
+    for (size_t pos = 0; pos < len; pos += dp->d_reclen) {
+        dp = (const struct walk_dirent64 *) (dents + pos);
+        if (atomic_load(&pool.abort))
+            return -1;
+        if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+        (*count)++;
+        if (!inode_order)
+            ret = walk_entry(task, dp->d_name);
+        else {
+            walk_entry_add(dp);
+            if (scratch.nentries == WALK_BATCH)
+                ret = walk_entries(task);
+        }
+        if (ret)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Hand the len bytes of entries read in the directory of task over to an
+ * idle worker, in a chunk task owning the buffer. Entries are handed over
+ * only if the buffer is large enough to be worth it, small directories are
+ * always processed by their walker.
+ *
+ * Returns true if the entries have been handed over, false otherwise.
+ */
+static bool walk_chunk_push(struct walk_task *task, size_t len) {
+    struct walk_task *chunk;
+
+    if (pool.nworkers == 1 || len < WALK_CHUNK_MIN
+        || atomic_load(&pool.idle) == 0)
+        return false;
+    chunk = walk_task_new(task, "");
+    chunk->dents = scratch.dents;
+    chunk->dentslen = len;
+    scratch.dents = xmalloc(WALK_DENTS_SIZE);
+    walk_push(chunk);
+    return true;
+}
+
+/*
+ * Set the user as the owner of all entries of the directory of the task and
+ * push tasks for its subdirectories. With --incremental, the content of the
+ * directory is skipped if it has not changed since previous run, and the
+ * directory is recorded in the index if all its entries have been processed
+ * and are compliant.
+ */
+static void walk_directory(struct walk_task *task) {
+    char *probe_path = NULL;
+    const struct incremental_record *record = NULL;
+    struct stat st;
+    bool indexed = false, chunked = false;
+    unsigned long long start;
+    size_t count = 0;
+    ssize_t len;
+    int ret = 0;
+
+    if (PROBE_ENABLED(dir__start) || PROBE_ENABLED(dir__done))
+        probe_path = walk_path(task->parent, task->name);
+    PROBE(dir__start, probe_path);
+
+    // Unable to open directory
+    if (walk_open(task)) {
+        STATS_INC(errors);
+        atomic_store(&pool.status, 1);
+        PROBE(dir__done, probe_path, count, -1);
+        free(probe_path);
+        return;
+    }
+    STATS_INC(directories);
+
+    /*
+     * The status is taken before reading the entries, so changes during the
+     * walk are detected on next run. Directories changed in the last second
+     * are not recorded, as further changes in the same timestamp tick would
+     * not be detected.
+     */
+    if (incremental.filename && fstat(task->fd, &st) == 0) {
+        record = incremental_lookup(&st);
+        indexed = st.st_ctim.tv_sec < time(NULL) - 1;
+    }
+
+    if (verbose) {
+        char *path = walk_path(task->parent, task->name);
+
+        if (record)
+            VERBOSE(_("Skipping unchanged directory %s content\n"), path);
+        else if (plan.fp)
+            VERBOSE(_("Scanning directory %s content\n"), path);
+        else
+            VERBOSE(_("Changing %sowner of directory %s content\n"),
+                    recurse ? "recursively " : "", path);
+        free(path);
+    }
+
+    scratch.len = 0;
+    scratch.nsubdirs = 0;
+    scratch.partial = false;
+    if (record) {
+        ret = walk_unchanged(task, record);
+    } else {
+        if (scratch.dents == NULL)
+            scratch.dents = xmalloc(WALK_DENTS_SIZE);
+        while (ret == 0 && !atomic_load(&pool.abort)) {
+            start = stats_begin();
+            len = syscall(SYS_getdents64, task->fd, scratch.dents,
+                          WALK_DENTS_SIZE);
+            stats_end(STATS_READDIR, start);
+            if (len <= 0) {
+                if (len == -1) {
+                    char *path = walk_path(task->parent, task->name);
+
+                    ERROR(_("Failed to read directory '%s': %s (%d)\n"),
+                          path, strerror(errno), errno);
+                    free(path);
+                    STATS_INC(errors);
+                    atomic_store(&pool.status, 1);
+                    ret = 1;
+                }
+                break;
+            }
+            if (walk_chunk_push(task, len))
+                chunked = true;
+            else
+                ret = walk_dents(task, scratch.dents, len, &count);
+        }
+    }
+    if (scratch.nentries) {
+        if (ret == 0)
+            ret = walk_entries(task);
+        scratch.nentries = 0;
+        scratch.entries_len = 0;
+    }
+    plan_flush();
+
+    /*
+     * chunks handed over are not known and pruned entries would be skipped by
+     * runs with other options, the directory is not recorded
+     */
+    if (indexed && !chunked && !scratch.partial && ret == 0
+        && !atomic_load(&pool.abort))
+        incremental_add(&st, scratch.names, scratch.len, scratch.nsubdirs);
+    PROBE(dir__done, probe_path, count, ret);
+    free(probe_path);
+    if (scratch.nsubdirs == 0)
+        return;
+
+    /*
+     * Beyond the budget of open file descriptors, the directory is closed and
+     * its subdirectories are reopened relative to an ancestor. It is kept
+     * open for the chunks of its entries handed over to other workers.
+     */
+    if (!chunked && atomic_load(&walk_open_fds) > fd_budget) {
+        close(task->fd);
+        task->fd = -1;
+        atomic_fetch_sub(&walk_open_fds, 1);
+    }
+
+    /*
+     * Push subdirectories in reverse order so the owner pops them in
+     * processing order while thieves steal the last ones.
+     */
+    walk_batch_new(task);
+    while (scratch.nsubdirs)
+        walk_push(scratch.subdirs[--scratch.nsubdirs].task);
+}
+
+/*
+ * Process the entries of the parent directory handed over in chunk task, and
+ * push tasks for the subdirectories found in these entries.
+ */
+static void walk_chunk(struct walk_task *task) {
+    struct walk_task *dir = task->parent;
+    size_t count = 0;
+    int ret;
+
+    scratch.len = 0;
+    scratch.nsubdirs = 0;
+    ret = walk_dents(dir, task->dents, task->dentslen, &count);
+    if (scratch.nentries) {
+        if (ret == 0)
+            walk_entries(dir);
+        scratch.nentries = 0;
+        scratch.entries_len = 0;
+    }
+    plan_flush();
+
+    /* subdirectories take their references on dir fd before the chunk ones */
+    if (scratch.nsubdirs) {
+        walk_batch_new(dir);
+        while (scratch.nsubdirs)
+            walk_push(scratch.subdirs[--scratch.nsubdirs].task);
+    }
+    walk_fd_release(dir);
+}
+
+/*
+ * Flush the report of the task and release it. If the task has not been
+ * processed (ie. walk is aborted), its parent file descriptor is released.
+ */
+static void walk_complete(struct walk_task *task, bool processed) {
+    if (task->report) {
+        pthread_mutex_lock(&pool.report_lock);
+        task->report->done = true;
+        report_flush();
+        pthread_mutex_unlock(&pool.report_lock);
+    }
+    if (!processed && task->parent)
+        walk_fd_release(task->parent);
+    walk_fd_release(task);
+    walk_task_release(task);
+
+    if (atomic_fetch_sub(&pool.pending, 1) == 1) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/**********************************************************
+ *                                                        *
+ *                      Checkpoints                       *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * When a checkpoint file is given, the pending directories of the walk are
+ * regularly saved in this file, so an interrupted walk can be resumed without
+ * processing again the directories already completed.
+ *
+ * The pending directories are the directories waiting in workers deques and
+ * the directories being processed. Workers take tasks and complete them with
+ * the snapshot lock held for reading, so a task is always either in a deque
+ * or current for a worker when the snapshot lock is held for writing. The
+ * subdirectories pushed by a directory being processed may be saved twice,
+ * this is harmless as prown operations are idempotent.
+ *
+ * Checkpoint file format is:
+ *
+ *   prown-checkpoint 1\n
+ *   <root path>\0
+ *   <shared> <suffix>\0
+ *   …
+ *
+ * with one record per pending directory, sorted, with its path relative to
+ * root. The record stores the length of the prefix shared with the previous
+ * path and the remaining suffix. An empty path is the root itself.
+ */
+
+#define CHECKPOINT_MAGIC "prown-checkpoint 1\n"
+
+static atomic_bool terminated;
+
+long long monotonic_time(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Add path of task relative to walk root in paths array.
+ */
+static void checkpoint_add(char ***paths, size_t *npaths, size_t *size,
+                           struct walk_task *task) {
+    char *path, *rel;
+    size_t rootlen = strlen(pool.root);
+
+    /* entries of a chunk are processed again with their whole directory */
+    if (task->dents)
+        task = task->parent;
+    path = walk_path(task->parent, task->name);
+
+    if (task->parent == NULL)
+        rel = strdup("");
+    else
+        rel = strdup(path + rootlen + 1);
+    free(path);
+    if (rel == NULL) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+    if (*npaths == *size) {
+        *size = *size ? *size * 2 : 64;
+        *paths = xrealloc(*paths, *size * sizeof(char *));
+    }
+    (*paths)[(*npaths)++] = rel;
+}
+
+/*
+ * Save pending directories of the current walk in checkpoint file. The file
+ * is written in a temporary file and then renamed atomically.
+ */
+static void checkpoint_save(void) {
+    char **paths = NULL, *tmp;
+    size_t npaths = 0, size = 0;
+    const char *prev = "";
+    FILE *fp;
+
+    pthread_rwlock_wrlock(&pool.snapshot_lock);
+    for (int i = 0; i < pool.nworkers; i++) {
+        struct walk_deque *deque = &pool.deques[i];
+
+        pthread_mutex_lock(&deque->lock);
+        for (size_t j = deque->head; j < deque->tail; j++)
+            checkpoint_add(&paths, &npaths, &size, deque->tasks[j]);
+        pthread_mutex_unlock(&deque->lock);
+        if (pool.current[i])
+            checkpoint_add(&paths, &npaths, &size, pool.current[i]);
+    }
+    pthread_rwlock_unlock(&pool.snapshot_lock);
+
+    qsort(paths, npaths, sizeof(char *), cmp_str);
+
+    if (asprintf(&tmp, "%s.tmp", checkpoint_file) == -1) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        ERROR(_("Failed to save checkpoint in %s: %s\n"), tmp,
+              strerror(errno));
+        goto end;
+    }
+    fputs(CHECKPOINT_MAGIC, fp);
+    fwrite(pool.root, 1, strlen(pool.root) + 1, fp);
+    for (size_t i = 0; i < npaths; i++) {
+        size_t shared = 0;
+
+        if (i && strcmp(paths[i], prev) == 0)
+            continue;           /* saved twice, see above */
+        while (prev[shared] && prev[shared] == paths[i][shared])
+            shared++;
+        fprintf(fp, "%zu %s", shared, paths[i] + shared);
+        fputc('\0', fp);
+        prev = paths[i];
+    }
+    if (fflush(fp) || fsync(fileno(fp)) || ferror(fp)) {
+        ERROR(_("Failed to save checkpoint in %s: %s\n"), tmp,
+              strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        goto end;
+    }
+    fclose(fp);
+    if (rename(tmp, checkpoint_file))
+        ERROR(_("Failed to save checkpoint in %s: %s\n"), checkpoint_file,
+              strerror(errno));
+  end:
+    for (size_t i = 0; i < npaths; i++)
+        free(paths[i]);
+    free(paths);
+    free(tmp);
+}
+
+/*
+ * Save checkpoint if the interval since the last one is over, or if prown has
+ * been asked to terminate. In this case, the walk is also aborted.
+ */
+static void checkpoint_maybe(void) {
+    long long next = atomic_load(&pool.next_checkpoint);
+    long long now = monotonic_time();
+
+    if (now < next)
+        return;
+    if (!atomic_compare_exchange_strong(&pool.next_checkpoint, &next,
+                                        now + checkpoint_interval))
+        return;
+    checkpoint_save();
+    if (atomic_load(&terminated)) {
+        ERROR(_("Walk interrupted, progress saved in %s\n"),
+              checkpoint_file);
+        walk_fail();
+    }
+}
+
+void checkpoint_signal(int signum) {
+    (void) signum;
+    atomic_store(&terminated, true);
+    atomic_store(&pool.next_checkpoint, 0);
+}
+
+/*
+ * Returns true if path is empty or a relative path without . and ..
+ * components, ie. it cannot go outside of the directory it is relative to.
+ */
+static bool is_relative_subpath(const char *path) {
+    const char *p = path;
+
+    if (*p == '/')
+        return false;
+    while (*p) {
+        const char *end = strchrnul(p, '/');
+
+        if (end == p || (end - p == 1 && p[0] == '.')
+            || (end - p == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+        p = *end ? end + 1 : end;
+    }
+    return true;
+}
+
+/*
+ * Load checkpoint file, setting root with the path of walk root and subdirs
+ * with the array of pending directories relative to this root.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+int checkpoint_load(const char *filename, char **root, char ***subdirs,
+                    size_t *nsubdirs) {
+    FILE *fp;
+    char *record = NULL, *prev = NULL;
+    size_t size = 0, allocated = 0;
+    ssize_t len;
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        ERROR(_("Failed to open checkpoint file %s: %s\n"), filename,
+              strerror(errno));
+        return -1;
+    }
+    *root = NULL;
+    *subdirs = NULL;
+    *nsubdirs = 0;
+    if (fgets(magic, sizeof(magic), fp) == NULL
+        || strcmp(magic, CHECKPOINT_MAGIC)
+        || getdelim(root, &size, '\0', fp) <= 1)
+        goto invalid;
+
+    while ((len = getdelim(&record, &size, '\0', fp)) != -1) {
+        size_t shared;
+        char *suffix, *path;
+
+        shared = strtoul(record, &suffix, 10);
+        if (*suffix != ' ' || record[len - 1] != '\0'
+            || shared > (prev ? strlen(prev) : 0))
+            goto invalid;
+        suffix++;
+        path = xmalloc(shared + strlen(suffix) + 1);
+        if (shared)
+            memcpy(path, prev, shared);
+        strcpy(path + shared, suffix);
+        if (!is_relative_subpath(path)) {
+            free(path);
+            goto invalid;
+        }
+        if (*nsubdirs == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            *subdirs = xrealloc(*subdirs, allocated * sizeof(char *));
+        }
+        (*subdirs)[(*nsubdirs)++] = path;
+        prev = path;
+    }
+    if (ferror(fp))
+        goto invalid;
+    free(record);
+    fclose(fp);
+    return 0;
+
+  invalid:
+    ERROR(_("Invalid checkpoint file %s\n"), filename);
+    for (size_t i = 0; i < *nsubdirs; i++)
+        free((*subdirs)[i]);
+    free(*subdirs);
+    free(*root);
+    free(record);
+    fclose(fp);
+    return -1;
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_task *task;
+
+    worker_id = (int) (intptr_t) arg;
+    stats_local = &stats_slots[worker_id];
+
+    while (!atomic_load(&pool.abort)) {
+        if ((task = walk_next()) != NULL) {
+            current_report = task->report;
+            if (task->dents)
+                walk_chunk(task);
+            else
+                walk_directory(task);
+            current_report = NULL;
+            if (checkpoint_file) {
+                pthread_rwlock_rdlock(&pool.snapshot_lock);
+                pool.current[worker_id] = NULL;
+                pthread_rwlock_unlock(&pool.snapshot_lock);
+            }
+            walk_complete(task, true);
+            if (checkpoint_file)
+                checkpoint_maybe();
+            continue;
+        }
+
+        /*
+         * Nothing to steal: sleep until a task is pushed or the walk is over.
+         * The idle counter is raised before checking the queued counter so
+         * walk_push() cannot miss this worker.
+         */
+        pthread_mutex_lock(&pool.lock);
+        atomic_fetch_add(&pool.idle, 1);
+        while (atomic_load(&pool.queued) == 0
+               && atomic_load(&pool.pending) > 0
+               && !atomic_load(&pool.abort))
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        atomic_fetch_sub(&pool.idle, 1);
+        if (atomic_load(&pool.pending) == 0) {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    free(scratch.dents);
+    free(scratch.names);
+    free(scratch.subdirs);
+    free(scratch.entries_names);
+    free(scratch.entries);
+    memset(&scratch, 0, sizeof(scratch));
+    if (journal.fd != -1)
+        journal_flush();
+    if (output.enabled)
+        output_flush();
+    free(output_local.data);
+    output_local.data = NULL;
+    return NULL;
+}
+
+/*
+ * Walk directories of tasks, relative to root, with the configured number of
+ * worker threads. Tasks are processed in the given order. Reports are flushed
+ * starting with the given report.
+ *
+ * Returns 0 if valid, 1 if some directories could not be processed and -1 if
+ * the walk has been aborted due to a fatal error.
+ */
+static int walk_run(const char *root, struct walk_task **tasks, size_t ntasks,
+                    struct report *flushed) {
+    pthread_t *threads;
+    struct walk_task *task;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.nworkers = jobs;
+    if (fd_budget == 0) {
+        struct rlimit rl;
+
+        /* half of the limit, the other half is left for streams and dups */
+        fd_budget = 512;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+            fd_budget = rl.rlim_cur == RLIM_INFINITY
+                || rl.rlim_cur / 2 > INT_MAX ? INT_MAX : rl.rlim_cur / 2;
+    }
+    pool.deques = xmalloc(jobs * sizeof(struct walk_deque));
+    memset(pool.deques, 0, jobs * sizeof(struct walk_deque));
+    for (int i = 0; i < jobs; i++)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pthread_mutex_init(&pool.report_lock, NULL);
+    pool.root = root;
+    if (checkpoint_file) {
+        pool.current = xmalloc(jobs * sizeof(struct walk_task *));
+        memset(pool.current, 0, jobs * sizeof(struct walk_task *));
+        pthread_rwlock_init(&pool.snapshot_lock, NULL);
+        atomic_store(&pool.next_checkpoint,
+                     monotonic_time() + checkpoint_interval);
+        if (atomic_load(&terminated))
+            atomic_store(&pool.next_checkpoint, 0);
+    }
+
+    /* current thread is worker 0 */
+    worker_id = 0;
+    fflush(stdout);
+    pool.flushed = flushed;
+    while (ntasks)
+        walk_push(tasks[--ntasks]);
+
+    threads = xmalloc(jobs * sizeof(pthread_t));
+    for (int i = 1; i < jobs; i++) {
+        int rc = pthread_create(&threads[i], NULL, walk_worker,
+                                (void *) (intptr_t) i);
+
+        if (rc) {
+            ERROR(_("Unable to create thread: %s\n"), strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+    walk_worker((void *) 0);
+    for (int i = 1; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    /*
+     * The walk is over, remove checkpoint. If aborted, the last checkpoint is
+     * kept to resume the walk.
+     */
+    if (checkpoint_file && !atomic_load(&pool.abort))
+        unlink(checkpoint_file);
+
+    /* release tasks left behind after abort, this also flushes reports */
+    for (int i = 0; i < jobs; i++) {
+        while ((task = walk_take(i, false)) != NULL)
+            walk_complete(task, false);
+    }
+    report_flush();
+    for (int i = 0; i < jobs; i++) {
+        free(pool.deques[i].tasks);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(pool.deques);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    pthread_mutex_destroy(&pool.report_lock);
+    if (checkpoint_file) {
+        free(pool.current);
+        pthread_rwlock_destroy(&pool.snapshot_lock);
+    }
+
+    if (atomic_load(&pool.abort))
+        return -1;
+    return atomic_load(&pool.status);
+}
+
+/*
+ * set recursively the user as the owner of the project, with the configured
+ * number of worker threads.
+ *
+ * Returns 0 if valid, 1 if some directories could not be processed and -1 if
+ * the walk has been aborted due to a fatal error.
+ * */
+int projectOwner(char *basepath, const char *project_root) {
+    struct stat buf;
+    struct walk_task *task;
+    int status;
+
+    lstat(basepath, &buf);
+    if (!S_ISDIR(buf.st_mode))
+        return 0;
+
+    task = walk_root_new(basepath, project_root);
+    PROBE(walk__start, basepath);
+    status = walk_run(basepath, &task, 1, task->report);
+    PROBE(walk__done, basepath, status);
+    return status;
+}
+
+/*
+ * Resume the walk of basepath interrupted with the given subdirectories
+ * (relative to basepath) still to process. Subdirectories are processed
+ * recursively, as with projectOwner().
+ *
+ * Returns 0 if valid, 1 if some directories could not be processed and -1 if
+ * the walk has been aborted due to a fatal error.
+ */
+int projectOwnerResume(char *basepath, const char *project_root,
+                       char **subdirs, size_t nsubdirs) {
+    struct walk_task *root, **tasks;
+    int status;
+
+    /* the root is not walked again, it is only parent of subdirectories */
+    root = walk_root_new(basepath, project_root);
+    root->fd = open(basepath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                    O_CLOEXEC);
+    if (root->fd == -1) {
+        ERROR(_("Failed to open directory '%s': %s (%d)\n"), basepath,
+              strerror(errno), errno);
+        walk_fd_release(root);
+        walk_task_release(root);
+        return 1;
+    }
+    atomic_fetch_add(&walk_open_fds, 1);
+    walk_task_stat(root);
+    if (root->report)
+        root->report->done = true;
+
+    tasks = xmalloc((nsubdirs ? nsubdirs : 1) * sizeof(struct walk_task *));
+    for (size_t i = 0; i < nsubdirs; i++)
+        tasks[i] = walk_task_new(root, subdirs[i]);
+    walk_fd_release(root);
+    status = walk_run(basepath, tasks, nsubdirs, root->report);
+    walk_task_release(root);
+    free(tasks);
+    return status;
+}
+
+/*
+ * Resolve real_dir, the canonical path of path, and project_root, the root
+ * directory of the project containing this path. The real_dir and
+ * project_root arguments must be preallocated strings of PATH_MAX.
+ *
+ * Returns 0 on success, -1 if path is discarded.
+ */
+int resolve_project(const char *path, char *real_dir, char *project_root) {
+    char project_parent[PATH_MAX];
+
+    /* clean allocated memory for strings */
+    memset(real_dir, 0, PATH_MAX);
+    memset(project_parent, 0, PATH_MAX);
+    memset(project_root, 0, PATH_MAX);
+
+    // check the real path is correct
+    if (!realpath(path, real_dir)) {
+        ERROR(_("Path '%s' has not been found, it is discarded\n"), path);
+        return -1;
+    }
+
+    /* check path is under projects roots directories */
+    if (!is_in_projects_parents(project_parent, real_dir)) {
+        ERROR(_("Changing owner of file outside project parent directories "
+                "is prohibited, path '%s' is discarded\n"), path);
+        return -1;
+    }
+
+    /* get project root directory */
+    get_project_root(project_parent, real_dir, project_root);
+    return 0;
+}
+
+/*
+ * Set the user as owner of real_dir in project_root, recursively if
+ * enabled. The user must have been granted in this project. With --shard,
+ * real_dir is modified only if it belongs to this shard, and it is walked
+ * only if it is above the split depth or if it belongs to this shard.
+ *
+ * Returns 0 if valid, 1 if some directories could not be processed and -1 if
+ * processing has been aborted due to a fatal error.
+ */
+int prownPath(char *real_dir, const char *project_root) {
+    struct stat path_stat;
+    struct entry_stat est;
+    int depth;
+    bool owned = shard_owns(shard_path_hash(real_dir, project_root, &depth));
+
+    if (!owned && depth >= shard.depth)
+        return 0;
+    if (plan.fp)
+        plan_root(real_dir);
+    stat(real_dir, &path_stat);
+    //if it's a file we should call setOwner one time
+    if (path_stat.st_mode & S_IFREG) {
+        if (owned && setOwner(AT_FDCWD, real_dir, NULL, &est) < 0)
+            return -1;
+        plan_flush();
+    } else {
+        // chown the real_dir if it's not the projectDir
+        // because projectOwner() doesn't chown the entry path
+        // but only the chlids
+        if (owned && strcmp(real_dir, project_root)
+            && setOwner(AT_FDCWD, real_dir, NULL, &est) < 0)
+            return -1;
+        plan_flush();
+        if (recurse && max_depth != 0)
+            return projectOwner(real_dir, project_root);
+    }
+    return 0;
+}
+
+/*
+ * Process path given on command line, if the user is granted in its project.
+ *
+ * Returns 0 on success or if the path is discarded, -1 if the processing
+ * must be aborted.
+ */
+int prownProject(char *path) {
+    char real_dir[PATH_MAX], project_root[PATH_MAX];
+    int granted;
+
+    VERBOSE(_("+ Processing path %s\n"), path);
+
+    if (resolve_project(path, real_dir, project_root))
+        return 0;
+
+    /* check user is administrator of this project */
+    if ((granted = check_project_admin(project_root)) == -1)
+        return -1;
+    if (!granted) {
+        ERROR(_("Permission denied for project %s, you are not a member of "
+                "this project administor groups\n"), project_root);
+        return 0;
+    } else
+        VERBOSE(_("User is granted to prown in project directory %s\n"),
+                project_root);
+
+    return prownPath(real_dir, project_root) == -1 ? -1 : 0;
+}
+
+/*
+ * Authorization of the user in a project root, memoized when processing list
+ * of paths.
+ */
+struct project_grant {
+    char *project_root;
+    bool granted;
+};
+
+static int cmp_project_grant(const void *a, const void *b) {
+    return strcmp(((const struct project_grant *) a)->project_root,
+                  ((const struct project_grant *) b)->project_root);
+}
+
+/*
+ * Process all paths read from file (or standard input if filename is -),
+ * separated by delim. Paths are processed as they are read, the user is
+ * checked once per project and this result is reused for all the following
+ * paths in the same project. Messages of denied projects are reported once.
+ *
+ * Returns 0 on success, -1 if the processing must be aborted.
+ */
+int prownFilesFrom(const char *filename, int delim) {
+    struct project_grant *grants = NULL, *grant, key;
+    size_t ngrants = 0;
+    char real_dir[PATH_MAX], project_root[PATH_MAX];
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *fp = stdin;
+    int rc = 0;
+
+    if (strcmp(filename, "-") && (fp = fopen(filename, "r")) == NULL) {
+        ERROR(_("Failed to open paths file %s: %s\n"), filename,
+              strerror(errno));
+        return -1;
+    }
+
+    while ((len = getdelim(&line, &size, delim, fp)) != -1) {
+        if (len && line[len - 1] == delim)
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        VERBOSE(_("+ Processing path %s\n"), line);
+
+        if (resolve_project(line, real_dir, project_root))
+            continue;
+
+        key.project_root = project_root;
+        grant = bsearch(&key, grants, ngrants, sizeof(struct project_grant),
+                        cmp_project_grant);
+        if (grant == NULL) {
+            size_t pos = 0;
+
+            /* check user is administrator of this new project */
+            while (pos < ngrants
+                   && strcmp(grants[pos].project_root, project_root) < 0)
+                pos++;
+            grants = xrealloc(grants, (ngrants + 1) *
+                              sizeof(struct project_grant));
+            memmove(&grants[pos + 1], &grants[pos],
+                    (ngrants - pos) * sizeof(struct project_grant));
+            ngrants++;
+            grant = &grants[pos];
+            grant->project_root = strdup(project_root);
+            if (grant->project_root == NULL) {
+                ERROR(_("Unable to allocate memory\n"));
+                exit(EXIT_FAILURE);
+            }
+            if ((rc = check_project_admin(project_root)) == -1)
+                break;
+            grant->granted = rc;
+            rc = 0;
+            if (!grant->granted)
+                ERROR(_("Permission denied for project %s, you are not a "
+                        "member of this project administor groups\n"),
+                      project_root);
+        }
+        if (!grant->granted)
+            continue;
+
+        VERBOSE(_("User is granted to prown in project directory %s\n"),
+                project_root);
+        if (prownPath(real_dir, project_root) == -1) {
+            rc = -1;
+            break;
+        }
+    }
+
+    if (rc == 0 && ferror(fp)) {
+        ERROR(_("Unable to read paths file %s\n"), filename);
+        rc = -1;
+    }
+    if (fp != stdin)
+        fclose(fp);
+    for (size_t i = 0; i < ngrants; i++)
+        free(grants[i].project_root);
+    free(grants);
+    free(line);
+    return rc;
+}
+
+/*
+ * Resume the walk saved in checkpoint file. The user must still be granted in
+ * the project of the walk root. Progress is saved in the same checkpoint file
+ * unless another one is given.
+ *
+ * Returns 0 on success or if the walk is discarded, -1 if the processing must
+ * be aborted.
+ */
+int prownResume(char *filename) {
+    char real_dir[PATH_MAX], project_root[PATH_MAX];
+    char *root, **subdirs;
+    size_t nsubdirs;
+    bool from_root = false;
+    int status = 0, granted;
+
+    if (checkpoint_load(filename, &root, &subdirs, &nsubdirs))
+        return -1;
+
+    VERBOSE(_("+ Resuming walk of path %s\n"), root);
+
+    if (resolve_project(root, real_dir, project_root))
+        goto end;
+    if (strcmp(real_dir, root)) {
+        ERROR(_("Path '%s' has changed, walk cannot be resumed\n"), root);
+        goto end;
+    }
+
+    /* check user is administrator of this project */
+    if ((granted = check_project_admin(project_root)) == -1) {
+        status = -1;
+        goto end;
+    }
+    if (!granted) {
+        ERROR(_("Permission denied for project %s, you are not a member of "
+                "this project administor groups\n"), project_root);
+        goto end;
+    } else
+        VERBOSE(_("User is granted to prown in project directory %s\n"),
+                project_root);
+
+    if (checkpoint_file == NULL)
+        checkpoint_file = filename;
+    for (size_t i = 0; i < nsubdirs; i++)
+        from_root |= (*subdirs[i] == '\0');
+    if (from_root)
+        status = projectOwner(real_dir, project_root);
+    else
+        status = projectOwnerResume(real_dir, project_root, subdirs,
+                                    nsubdirs);
+
+  end:
+    for (size_t i = 0; i < nsubdirs; i++)
+        free(subdirs[i]);
+    free(subdirs);
+    free(root);
+    return status == -1 ? -1 : 0;
+}
+
+/*
+ * Open the directory of entry path relative to root, whose full path is used
+ * in messages, without following symlinks. The file descriptors of root and
+ * of the directory of the last entry, whose path is in dirpath, are kept open
+ * for the following entries.
+ *
+ * Returns the directory file descriptor, AT_FDCWD if path is empty (the root
+ * itself), -1 if an error has been reported.
+ */
+static int open_entry_dir(const char *root, const char *path,
+                          const char *full, int *rootfd, int *dirfd,
+                          char **dirpath) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    const char *name = strrchr(path, '/');
+    size_t dirlen = name ? (size_t) (name - path) : 0;
+
+    if (*path == '\0')
+        return AT_FDCWD;
+    if (*rootfd == -1 && (*rootfd = open(root, flags)) == -1) {
+        ERROR(_("Failed to open directory '%s': %s (%d)\n"), root,
+              strerror(errno), errno);
+        return -1;
+    }
+    if (*dirpath == NULL || strlen(*dirpath) != dirlen
+        || strncmp(*dirpath, path, dirlen)) {
+        if (*dirfd != -1 && *dirfd != *rootfd)
+            close(*dirfd);
+        free(*dirpath);
+        *dirpath = strndup(path, dirlen);
+        if (*dirpath == NULL) {
+            ERROR(_("Unable to allocate memory\n"));
+            exit(EXIT_FAILURE);
+        }
+        *dirfd = dirlen ? open_beneath(*rootfd, *dirpath) : *rootfd;
+        if (*dirfd == -1)
+            ERROR(_("Failed to open directory of '%s': %s (%d)\n"),
+                  full, strerror(errno), errno);
+    }
+    return *dirfd;
+}
+
+/*
+ * Change entry path of plan, relative to root, if it is still in the state
+ * expected when the plan was created. Directories file descriptors are kept
+ * open for the following entries, as in open_entry_dir().
+ *
+ * Returns 0 on success or if the entry is skipped, -1 if it cannot be
+ * changed.
+ */
+static int plan_apply_entry(const char *root, const char *path,
+                             const struct entry_stat *expected, int *rootfd,
+                             int *dirfd, char **dirpath) {
+    const char *name = strrchr(path, '/');
+    struct entry_stat est, old;
+    char *full;
+    int fd;
+    int ret = 0, error;
+
+    /* the root itself is changed with its full path */
+    name = *path == '\0' ? root : name ? name + 1 : path;
+    full = xmalloc(strlen(root) + strlen(path) + 2);
+    sprintf(full, *path ? "%s/%s" : "%s", root, path);
+
+    if ((fd = open_entry_dir(root, path, full, rootfd, dirfd, dirpath)) == -1)
+        goto end;
+    if (get_entry_stat(fd, name, &est)) {
+        ERROR(_("Entry %s has been removed since plan, it is skipped\n"),
+              full);
+        goto end;
+    }
+    if (est.dev != expected->dev || est.ino != expected->ino
+        || est.mode != expected->mode || est.uid != expected->uid) {
+        ERROR(_("Entry %s has changed since plan, it is skipped\n"), full);
+        goto end;
+    }
+    atomic_fetch_add_explicit(&counters.entries, 1, memory_order_relaxed);
+    old = est;
+    ret = changeOwner(fd, name, full, &est);
+    error = ret ? errno : 0;
+    if (journal.fd != -1 && (old.uid != est.uid || old.mode != est.mode))
+        journal_change(NULL, full, full, &old, &est);
+    if (output.enabled
+        && (ret || old.uid != est.uid || old.mode != est.mode))
+        output_entry(NULL, full, full, &old, &est, error);
+  end:
+    free(full);
+    return ret ? -1 : 0;
+}
+
+/*
+ * Apply the changes recorded in plan file, without walking the trees again.
+ * The plan must have been created by the same user, who must still be granted
+ * in the projects of the plan roots. Entries are changed only if they have
+ * the same device, inode, mode and owner as when the plan was created, they
+ * are skipped otherwise. The project root itself is never changed.
+ *
+ * Returns 0 on success, -1 if the plan cannot be applied or if an entry
+ * cannot be changed.
+ */
+int prownApply(const char *filename) {
+    char real_dir[PATH_MAX], project_root[PATH_MAX];
+    char magic[sizeof(PLAN_MAGIC)];
+    char *record = NULL, *prev = NULL, *root = NULL, *dirpath = NULL;
+    size_t size = 0;
+    ssize_t len;
+    unsigned uid;
+    int rootfd = -1, dirfd = -1, rc = 0, admin;
+    bool granted = false, project_root_plan = false;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        ERROR(_("Failed to open plan file %s: %s\n"), filename,
+              strerror(errno));
+        return -1;
+    }
+    if (fgets(magic, sizeof(magic), fp) == NULL || strcmp(magic, PLAN_MAGIC)
+        || fscanf(fp, "%u\n", &uid) != 1)
+        goto invalid;
+    if (uid != owner) {
+        ERROR(_("Plan file %s has been created by another user\n"),
+              filename);
+        rc = -1;
+        goto end;
+    }
+
+    while ((len = getdelim(&record, &size, '\0', fp)) != -1) {
+        struct entry_stat expected;
+        uintmax_t dev, ino;
+        unsigned mode, euid;
+        size_t shared;
+        int n;
+
+        if (record[len - 1] != '\0')
+            goto invalid;
+
+        /* new root, close file descriptors of the previous one */
+        if (*record == '/') {
+            if (dirfd != -1 && dirfd != rootfd)
+                close(dirfd);
+            if (rootfd != -1)
+                close(rootfd);
+            rootfd = dirfd = -1;
+            free(dirpath);
+            free(prev);
+            free(root);
+            dirpath = prev = NULL;
+            granted = false;
+            if ((root = strdup(record)) == NULL) {
+                ERROR(_("Unable to allocate memory\n"));
+                exit(EXIT_FAILURE);
+            }
+
+            VERBOSE(_("+ Applying plan of path %s\n"), root);
+
+            if (resolve_project(root, real_dir, project_root))
+                continue;
+            if (strcmp(real_dir, root)) {
+                ERROR(_("Path '%s' has changed, plan cannot be applied\n"),
+                      root);
+                continue;
+            }
+            /* check user is administrator of this project */
+            if ((admin = check_project_admin(project_root)) == -1) {
+                rc = -1;
+                goto end;
+            }
+            if (!admin) {
+                ERROR(_("Permission denied for project %s, you are not a "
+                        "member of this project administor groups\n"),
+                      project_root);
+                continue;
+            }
+            VERBOSE(_("User is granted to prown in project directory %s\n"),
+                    project_root);
+            granted = true;
+            /* as in prownPath(), project root itself is never changed */
+            project_root_plan = strcmp(root, project_root) == 0;
+            continue;
+        }
+
+        if (root == NULL
+            || sscanf(record, "%ju %ju %o %u %zu%n", &dev, &ino, &mode, &euid,
+                      &shared, &n) != 5 || record[n] != ' '
+            || shared > (prev ? strlen(prev) : 0))
+            goto invalid;
+        n++;
+        prev = xrealloc(prev, shared + strlen(record + n) + 1);
+        strcpy(prev + shared, record + n);
+        if (!is_relative_subpath(prev))
+            goto invalid;
+        if (!granted || (project_root_plan && *prev == '\0'))
+            continue;
+
+        expected.dev = dev;
+        expected.ino = ino;
+        expected.mode = mode;
+        expected.uid = euid;
+        if ((rc = plan_apply_entry(root, prev, &expected, &rootfd, &dirfd,
+                                   &dirpath)))
+            goto end;
+    }
+    if (ferror(fp))
+        goto invalid;
+
+  end:
+    if (dirfd != -1 && dirfd != rootfd)
+        close(dirfd);
+    if (rootfd != -1)
+        close(rootfd);
+    free(dirpath);
+    free(prev);
+    free(root);
+    free(record);
+    fclose(fp);
+    return rc;
+
+  invalid:
+    ERROR(_("Invalid plan file %s\n"), filename);
+    rc = -1;
+    goto end;
+}
+
+/*
+ * Entry of a journal to undo, with the project root of its path if the user
+ * is granted in this project.
+ */
+struct undo_entry {
+    struct journal_record record;
+    char *path;
+    const char *project_root;
+    size_t depth;               /* components in path */
+};
+
+/*
+ * Entries are undone in levels separated by barriers: first all the entries
+ * which are not directories, then directories from the deepest to the
+ * shallowest, so the user can still open the directories of entries until
+ * their own changes are undone. Entries of a level are sorted in reverse
+ * journal order.
+ */
+static struct {
+    struct undo_entry *entries;
+    size_t nentries;
+    char **roots;               /* project roots of entries */
+    size_t nroots;
+    uid_t uid;                  /* user who wrote the journal */
+    atomic_size_t kept;         /* owners not restored */
+    size_t *order;              /* indexes of entries to undo */
+    size_t *levels;             /* end of each level in order */
+    size_t nlevels;
+    pthread_barrier_t barrier;
+} undo;
+
+/*
+ * Restore the owner and the mode of the journal entry if it is still in the
+ * state recorded after the change. Directories file descriptors are kept open
+ * for the following entries, as in open_entry_dir(). Setuid and setgid bits
+ * are never restored, they are only kept on directories. The journal is a
+ * file of the user and its previous owners cannot be verified, so they are
+ * only restored by root: other users would be able to give their own files
+ * away to anyone with a forged journal.
+ */
+static void undo_entry(const struct undo_entry *entry, int *rootfd,
+                       int *dirfd, char **dirpath) {
+    const struct journal_record *record = &entry->record;
+    const char *path = entry->path + strlen(entry->project_root) + 1;
+    const char *name = strrchr(path, '/');
+    struct entry_stat est;
+    mode_t mode;
+    unsigned long long start;
+    int fd, ret;
+
+    name = name ? name + 1 : path;
+    fd = open_entry_dir(entry->project_root, path, entry->path, rootfd,
+                        dirfd, dirpath);
+    if (fd == -1)
+        return;
+    if (get_entry_stat(fd, name, &est)) {
+        ERROR(_("Entry %s has been removed since journal, it is skipped\n"),
+              entry->path);
+        return;
+    }
+    if (est.dev != record->dev || est.ino != record->ino
+        || est.uid != record->new_uid || est.mode != record->new_mode) {
+        ERROR(_("Entry %s has changed since journal, it is skipped\n"),
+              entry->path);
+        return;
+    }
+    mode = (record->old_mode & ~(S_IFMT | S_ISUID | S_ISGID))
+        | (S_ISDIR(est.mode) ? est.mode & (S_ISUID | S_ISGID) : 0);
+    atomic_fetch_add_explicit(&counters.entries, 1, memory_order_relaxed);
+    /* the mode is restored first, while the user still owns the entry */
+    if (!S_ISLNK(est.mode) && (est.mode & ~S_IFMT) != mode) {
+        VERBOSE(_("Restoring mode %04o of path %s\n"), (unsigned) mode,
+                entry->path);
+        governor_op();
+        start = stats_begin();
+        ret = fchmodat(fd, name, mode, 0);
+        stats_end(STATS_CHMOD, start);
+        if (ret) {
+            ERROR(_("Failed to restore mode of %s: %s\n"), entry->path,
+                  strerror(errno));
+            return;
+        }
+        atomic_fetch_add_explicit(&counters.chmoded, 1,
+                                  memory_order_relaxed);
+    }
+    if (est.uid != record->old_uid && owner != 0) {
+        atomic_fetch_add_explicit(&undo.kept, 1, memory_order_relaxed);
+    } else if (est.uid != record->old_uid) {
+        VERBOSE(_("Restoring owner %u of path %s\n"), record->old_uid,
+                entry->path);
+        governor_op();
+        start = stats_begin();
+        ret = fchownat(fd, name, record->old_uid, (gid_t) - 1,
+                       AT_SYMLINK_NOFOLLOW);
+        stats_end(STATS_CHOWN, start);
+        if (ret) {
+            ERROR(_("Failed to restore owner of %s: %s\n"), entry->path,
+                  strerror(errno));
+            return;
+        }
+        atomic_fetch_add_explicit(&counters.chowned, 1,
+                                  memory_order_relaxed);
+    }
+}
+
+/*
+ * Undo the journal entries of each level assigned to worker arg. Entries are
+ * assigned by inode, so successive changes of an entry are undone by the same
+ * worker in reverse order.
+ */
+static void *undo_worker(void *arg) {
+    const char *root = NULL;
+    char *dirpath = NULL;
+    int rootfd = -1, dirfd = -1;
+    size_t i = 0;
+
+    worker_id = (int) (intptr_t) arg;
+    stats_local = &stats_slots[worker_id];
+
+    for (size_t level = 0; level < undo.nlevels; level++) {
+        for (; i < undo.levels[level]; i++) {
+            const struct undo_entry *entry = &undo.entries[undo.order[i]];
+            uint64_t hash = (entry->record.dev ^ entry->record.ino)
+                * 0x9e3779b97f4a7c15ULL;
+
+            if ((int) ((hash >> 32) % jobs) != worker_id)
+                continue;
+            if (entry->project_root != root) {
+                if (dirfd != -1 && dirfd != rootfd)
+                    close(dirfd);
+                if (rootfd != -1)
+                    close(rootfd);
+                rootfd = dirfd = -1;
+                free(dirpath);
+                dirpath = NULL;
+                root = entry->project_root;
+            }
+            undo_entry(entry, &rootfd, &dirfd, &dirpath);
+        }
+        pthread_barrier_wait(&undo.barrier);
+    }
+    if (dirfd != -1 && dirfd != rootfd)
+        close(dirfd);
+    if (rootfd != -1)
+        close(rootfd);
+    free(dirpath);
+    return NULL;
+}
+
+/*
+ * Load the entries of journal file, with the project root of their paths if
+ * the user is granted in this project. Root can load the journal of any user
+ * in any project.
+ *
+ * Returns 0 on success, -1 if an error has been reported.
+ */
+static int undo_load(const char *filename) {
+    struct journal_header header;
+    struct journal_record record;
+    char project_parent[PATH_MAX], project_root[PATH_MAX];
+    bool *granted = NULL;
+    size_t size = 0;
+    int admin;
+    FILE *fp;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        ERROR(_("Failed to open journal file %s: %s\n"), filename,
+              strerror(errno));
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)))
+        goto invalid;
+    if (header.uid != owner && owner != 0) {
+        ERROR(_("Journal file %s has been created by another user\n"),
+              filename);
+        goto error;
+    }
+    undo.uid = header.uid;
+
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        struct undo_entry *entry;
+        size_t i;
+
+        /* only the changes performed by prown can be undone */
+        if (record.new_uid != undo.uid || record.pathlen == 0
+            || ((record.old_mode ^ record.new_mode)
+                & ~(S_IRGRP | S_IWGRP | S_ISUID | S_ISGID)))
+            goto invalid;
+        if (undo.nentries == size) {
+            size = size ? size * 2 : 1024;
+            undo.entries = xrealloc(undo.entries,
+                                    size * sizeof(struct undo_entry));
+        }
+        entry = &undo.entries[undo.nentries++];
+        entry->record = record;
+        entry->path = xmalloc(record.pathlen + 1);
+        entry->project_root = NULL;
+        if (fread(entry->path, record.pathlen, 1, fp) != 1)
+            goto invalid;
+        entry->path[record.pathlen] = '\0';
+        entry->depth = 0;
+        for (char *p = entry->path; *p; p++)
+            entry->depth += *p == '/';
+        if (*entry->path != '/' || strlen(entry->path) != record.pathlen
+            || !is_relative_subpath(entry->path + 1))
+            goto invalid;
+
+        /* check user once per project */
+        for (i = 0; i < undo.nroots; i++) {
+            size_t len = strlen(undo.roots[i]);
+
+            if (strncmp(entry->path, undo.roots[i], len) == 0
+                && entry->path[len] == '/')
+                break;
+        }
+        if (i == undo.nroots) {
+            if (!is_in_projects_parents(project_parent, entry->path)) {
+                ERROR(_("Changing owner of file outside project parent "
+                        "directories is prohibited, path '%s' is "
+                        "discarded\n"), entry->path);
+                continue;
+            }
+            get_project_root(project_parent, entry->path, project_root);
+            if (strcmp(entry->path, project_root) == 0)
+                continue;
+            undo.roots = xrealloc(undo.roots,
+                                  (undo.nroots + 1) * sizeof(char *));
+            granted = xrealloc(granted, (undo.nroots + 1) * sizeof(bool));
+            if ((undo.roots[i] = strdup(project_root)) == NULL) {
+                ERROR(_("Unable to allocate memory\n"));
+                exit(EXIT_FAILURE);
+            }
+            undo.nroots++;
+            if (owner == 0)
+                admin = 1;
+            else if ((admin = check_project_admin(project_root)) == -1)
+                goto error;
+            granted[i] = admin;
+            if (granted[i])
+                VERBOSE(_("User is granted to prown in project directory "
+                          "%s\n"), project_root);
+            else
+                ERROR(_("Permission denied for project %s, you are not a "
+                        "member of this project administor groups\n"),
+                      project_root);
+        }
+        if (!granted[i])
+            continue;
+        entry->project_root = undo.roots[i];
+    }
+    if (ferror(fp) || !feof(fp))
+        goto invalid;
+    fclose(fp);
+    free(granted);
+    return 0;
+
+  invalid:
+    ERROR(_("Invalid journal file %s\n"), filename);
+  error:
+    fclose(fp);
+    free(granted);
+    return -1;
+}
+
+/*
+ * Sort indexes of directories entries from the deepest, then in reverse
+ * journal order.
+ */
+static int cmp_undo_depth(const void *a, const void *b) {
+    size_t i = *(const size_t *) a, j = *(const size_t *) b;
+    size_t di = undo.entries[i].depth, dj = undo.entries[j].depth;
+
+    if (di != dj)
+        return di < dj ? 1 : -1;
+    return i < j ? 1 : (i > j ? -1 : 0);
+}
+
+/*
+ * Undo the changes recorded in journal file, in reverse order, with the
+ * configured number of worker threads. The journal must have been written by
+ * the same user, who must still be granted in the projects of its entries,
+ * or be undone by root. Entries are restored only if they are still in the
+ * state recorded after the changes, they are skipped otherwise. Previous
+ * owners are only restored by root.
+ *
+ * Returns 0 on success, -1 if the journal cannot be loaded.
+ */
+int prownUndo(const char *filename) {
+    pthread_t *threads;
+    size_t n = 0;
+    int rc = 0;
+
+    VERBOSE(_("+ Undoing changes of journal %s\n"), filename);
+    if (undo_load(filename)) {
+        rc = -1;
+        goto end;
+    }
+
+    /* entries which are not directories, then directories by level */
+    undo.order = xmalloc((undo.nentries ? undo.nentries : 1)
+                         * sizeof(size_t));
+    undo.levels = xmalloc((undo.nentries + 1) * sizeof(size_t));
+    for (size_t i = undo.nentries; i-- > 0;)
+        if (undo.entries[i].project_root
+            && !S_ISDIR(undo.entries[i].record.new_mode))
+            undo.order[n++] = i;
+    undo.levels[undo.nlevels++] = n;
+    for (size_t i = undo.nentries; i-- > 0;)
+        if (undo.entries[i].project_root
+            && S_ISDIR(undo.entries[i].record.new_mode))
+            undo.order[n++] = i;
+    qsort(undo.order + undo.levels[0], n - undo.levels[0], sizeof(size_t),
+          cmp_undo_depth);
+    for (size_t i = undo.levels[0] + 1; i <= n; i++)
+        if (i == n || undo.entries[undo.order[i]].depth
+            != undo.entries[undo.order[i - 1]].depth)
+            undo.levels[undo.nlevels++] = i;
+    pthread_barrier_init(&undo.barrier, NULL, jobs);
+
+    threads = xmalloc(jobs * sizeof(pthread_t));
+    for (int i = 1; i < jobs; i++) {
+        int rc = pthread_create(&threads[i], NULL, undo_worker,
+                                (void *) (intptr_t) i);
+
+        if (rc) {
+            ERROR(_("Unable to create thread: %s\n"), strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+    undo_worker((void *) 0);
+    for (int i = 1; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_barrier_destroy(&undo.barrier);
+    if (atomic_load(&undo.kept))
+        ERROR(_("Previous owners of %zu entries are not restored, only root "
+                "can restore them from journal %s\n"),
+              atomic_load(&undo.kept), filename);
+
+  end:
+    for (size_t i = 0; i < undo.nentries; i++)
+        free(undo.entries[i].path);
+    for (size_t i = 0; i < undo.nroots; i++)
+        free(undo.roots[i]);
+    free(undo.entries);
+    free(undo.roots);
+    free(undo.order);
+    free(undo.levels);
+    memset(&undo, 0, sizeof(undo));
+    return rc;
+}
+
+
+/**********************************************************
+ *                                                        *
+ *                      Estimation                        *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * With --estimate, the size of the tree under a path is estimated without
+ * walking it entirely, with Knuth's random walks estimator. A random walk
+ * reads a directory, picks one of its subdirectories at random and goes on
+ * until it reaches a directory without subdirectories. The numbers of entries
+ * of the directories of the walk, each multiplied by the product of the
+ * numbers of subdirectories of its ancestors, sum to an unbiased estimate of
+ * the number of entries of the tree. Walks are repeated until a budget of
+ * directories has been read, directories already read are kept in cache for
+ * the next walks. The dispersion of the estimates of the walks gives their
+ * confidence intervals.
+ *
+ * In each directory read, a random sample of entries is stat'ed to estimate
+ * the fraction of compliant entries. The latency of the metadata operations
+ * performed by the estimator gives the expected runtime of the processing.
+ */
+
+#define ESTIMATE_SAMPLE 16      /* entries stat'ed per directory */
+#define ESTIMATE_Z 1.96         /* 95% confidence intervals */
+
+struct estimate_dir {
+    dev_t dev;
+    ino_t ino;                  /* 0 if slot is empty */
+    size_t nentries;
+    size_t nsampled;            /* entries stat'ed */
+    size_t ncompliant;          /* and compliant among them */
+    char **subdirs;
+    size_t nsubdirs;
+};
+
+/* estimates of a random walk */
+struct estimate_walk {
+    double dirs;
+    double entries;
+    double compliant;
+    double ops;
+};
+
+static struct {
+    struct estimate_dir *dirs;  /* hash table of directories read */
+    size_t size;                /* power of 2 */
+    size_t ndirs;
+    size_t budget;
+    uint64_t random;
+    unsigned long long ops;     /* metadata operations performed */
+    unsigned long long ops_ns;  /* and their total duration */
+} estimate;
+
+/* xorshift64* pseudo-random generator */
+static uint64_t estimate_random(void) {
+    estimate.random ^= estimate.random >> 12;
+    estimate.random ^= estimate.random << 25;
+    estimate.random ^= estimate.random >> 27;
+    return estimate.random * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * Get status of entry name in directory dirfd, accounting the latency of the
+ * operation.
+ */
+static int estimate_stat(int dirfd, const char *name, struct entry_stat *est) {
+    unsigned long long start = now_ns();
+    int rc = get_entry_stat(dirfd, name, est);
+
+    estimate.ops++;
+    estimate.ops_ns += now_ns() - start;
+    return rc;
+}
+
+/* same rules as changeOwner() */
+static bool estimate_compliant(const struct entry_stat *est) {
+    return est->uid == owner && (S_ISLNK(est->mode)
+                                 || (est->mode & (S_IRGRP | S_IWGRP))
+                                 == (S_IRGRP | S_IWGRP));
+}
+
+static char *estimate_strdup(const char *s) {
+    char *dup = strdup(s);
+
+    if (dup == NULL) {
+        ERROR(_("Unable to allocate memory\n"));
+        exit(EXIT_FAILURE);
+    }
+    return dup;
+}
+
+/*
+ * Read the entries of directory fd in dir: count them, collect the names of
+ * its subdirectories, and stat a random sample of entries. Excluded entries
+ * are ignored, as in walks.
+ */
+static void estimate_read(int fd, struct estimate_dir *dir) {
+    char *dents = xmalloc(WALK_DENTS_SIZE), *sample[ESTIMATE_SAMPLE];
+    const struct walk_dirent64 *dp;
+    struct entry_stat est;
+    size_t nsample = 0, size = 0;
+    unsigned long long start;
+    ssize_t len;
+
+    for (;;) {
+        start = now_ns();
+        len = syscall(SYS_getdents64, fd, dents, WALK_DENTS_SIZE);
+        estimate.ops++;
+        estimate.ops_ns += now_ns() - start;
+        if (len <= 0)
+            break;
+        for (ssize_t pos = 0; pos < len; pos += dp->d_reclen) {
+            bool isdir;
+            size_t i;
+
+            dp = (const struct walk_dirent64 *) (dents + pos);
+            if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0
+                || exclude_match(dp->d_name))
+                continue;
+            dir->nentries++;
+
+            /* type is not returned by some filesystems */
+            isdir = dp->d_type == DT_DIR;
+            if (dp->d_type == DT_UNKNOWN)
+                isdir = estimate_stat(fd, dp->d_name, &est) == 0
+                    && S_ISDIR(est.mode);
+            if (isdir) {
+                if (dir->nsubdirs == size) {
+                    size = size ? size * 2 : 16;
+                    dir->subdirs = xrealloc(dir->subdirs,
+                                            size * sizeof(char *));
+                }
+                dir->subdirs[dir->nsubdirs++] = estimate_strdup(dp->d_name);
+            }
+
+            /* reservoir sampling of entries to stat */
+            if (nsample < ESTIMATE_SAMPLE) {
+                sample[nsample++] = estimate_strdup(dp->d_name);
+            } else if ((i = estimate_random() % dir->nentries)
+                       < ESTIMATE_SAMPLE) {
+                free(sample[i]);
+                sample[i] = estimate_strdup(dp->d_name);
+            }
+        }
+    }
+    free(dents);
+
+    for (size_t i = 0; i < nsample; i++) {
+        if (estimate_stat(fd, sample[i], &est) == 0) {
+            dir->nsampled++;
+            dir->ncompliant += estimate_compliant(&est);
+        }
+        free(sample[i]);
+    }
+}
+
+/*
+ * Returns the cached directory with status st, reading it if required, or
+ * NULL if the budget of directories is exhausted.
+ */
+static struct estimate_dir *estimate_dir(int fd, const struct stat *st) {
+    size_t i = visited_hash(st->st_dev, st->st_ino) & (estimate.size - 1);
+    struct estimate_dir *dir;
+
+    for (; estimate.dirs[i].ino; i = (i + 1) & (estimate.size - 1))
+        if (estimate.dirs[i].dev == st->st_dev
+            && estimate.dirs[i].ino == st->st_ino)
+            return &estimate.dirs[i];
+    if (estimate.ndirs == estimate.budget)
+        return NULL;
+    dir = &estimate.dirs[i];
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    estimate.ndirs++;
+    estimate_read(fd, dir);
+    return dir;
+}
+
+/*
+ * Random walk from directory rootfd, its estimates are stored in walk.
+ *
+ * Returns 0 on success, -1 if the budget has been exhausted before the end of
+ * the walk.
+ */
+static int estimate_walk(int rootfd, struct estimate_walk *walk) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    struct estimate_dir *dir;
+    struct stat st;
+    double weight = 1;
+    unsigned long long start;
+    int fd = rootfd, level = 0, rc = 0;
+
+    memset(walk, 0, sizeof(*walk));
+    for (;;) {
+        const char *name;
+        dev_t dev;
+        int subfd;
+
+        if (fstat(fd, &st) || (dir = estimate_dir(fd, &st)) == NULL) {
+            rc = -1;
+            break;
+        }
+        walk->dirs += weight;
+        walk->entries += weight * dir->nentries;
+        if (dir->nsampled)
+            walk->compliant += weight * dir->nentries * dir->ncompliant
+                / dir->nsampled;
+        if (dir->nsubdirs == 0 || (max_depth >= 0 && level + 1 >= max_depth))
+            break;
+
+        /* subdirectories which cannot be opened are not walked */
+        name = dir->subdirs[estimate_random() % dir->nsubdirs];
+        weight *= dir->nsubdirs;
+        dev = st.st_dev;
+        start = now_ns();
+        subfd = openat(fd, name, flags);
+        estimate.ops++;
+        estimate.ops_ns += now_ns() - start;
+        if (subfd == -1)
+            break;
+        if (fd != rootfd)
+            close(fd);
+        fd = subfd;
+        level++;
+        if (one_file_system && (fstat(fd, &st) || st.st_dev != dev))
+            break;
+    }
+    if (fd != rootfd)
+        close(fd);
+
+    /* an opendir, at least one getdents, a stat and changes if required */
+    walk->ops = walk->dirs * 2 + walk->entries
+        + (walk->entries - walk->compliant) * 2;
+    return rc;
+}
+
+/*
+ * Print an estimate with its confidence interval, given by its half width and
+ * clamped in [min, max], as member name of the JSON record or in text with
+ * format.
+ */
+static void estimate_print(const char *name, double mean, double half,
+                           double min, double max, const char *format) {
+    double low = mean - half < min ? min : mean - half;
+    double high = mean + half > max ? max : mean + half;
+
+    if (name && output_format == OUTPUT_NDJSON)
+        printf(",\"%s\":{\"estimate\":%.6g,\"low\":%.6g,\"high\":%.6g}", name,
+               mean, low, high);
+    else if (format)
+        printf(format, mean, low, high);
+}
+
+/*
+ * Estimate the number of entries under path, the fraction of compliant
+ * entries and the runtime of its processing by reading at most budget
+ * directories. The user must be granted in the project of path.
+ */
+int prownEstimate(char *path, size_t budget) {
+    char real_dir[PATH_MAX], project_root[PATH_MAX];
+    struct estimate_walk *walks = NULL, sum;
+    struct entry_stat est;
+    size_t nwalks = 0, size = 0;
+    double root = 0, root_compliant = 0, latency, f, var_e = 0, var_f = 0,
+        var_t = 0, mean_e, mean_t;
+    int rootfd, granted;
+
+    VERBOSE(_("+ Estimating path %s\n"), path);
+    if (resolve_project(path, real_dir, project_root))
+        return 0;
+    if ((granted = check_project_admin(project_root)) == -1)
+        return -1;
+    if (!granted) {
+        ERROR(_("Permission denied for project %s, you are not a member of "
+                "this project administor groups\n"), project_root);
+        return 0;
+    }
+
+    /* the path itself is processed, except project root */
+    if (strcmp(real_dir, project_root)
+        && get_entry_stat(AT_FDCWD, real_dir, &est) == 0) {
+        root = 1;
+        root_compliant = estimate_compliant(&est);
+    }
+
+    memset(&estimate, 0, sizeof(estimate));
+    estimate.budget = budget;
+    estimate.size = 16;
+    while (estimate.size < budget * 2)
+        estimate.size *= 2;
+    estimate.dirs = xmalloc(estimate.size * sizeof(struct estimate_dir));
+    memset(estimate.dirs, 0, estimate.size * sizeof(struct estimate_dir));
+    estimate.random = now_ns() ^ ((uint64_t) getpid() << 32);
+    if (estimate.random == 0)
+        estimate.random = 1;
+
+    rootfd = open(real_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (rootfd == -1 && errno != ENOTDIR) {
+        ERROR(_("Failed to open directory '%s': %s (%d)\n"), real_dir,
+              strerror(errno), errno);
+        free(estimate.dirs);
+        return 0;
+    }
+
+    /*
+     * Walks stop when the budget is exhausted, or after a bounded number of
+     * walks when the whole tree is in cache.
+     */
+    for (;;) {
+        if (nwalks == size) {
+            size = size ? size * 2 : 64;
+            walks = xrealloc(walks, size * sizeof(struct estimate_walk));
+        }
+        if (rootfd == -1) {
+            /* not a directory, the path itself only */
+            memset(&walks[nwalks++], 0, sizeof(struct estimate_walk));
+            break;
+        }
+        if (nwalks == budget * 4 || estimate_walk(rootfd, &walks[nwalks]))
+            break;
+        nwalks++;
+    }
+    if (rootfd != -1)
+        close(rootfd);
+    for (size_t i = 0; i < estimate.size; i++) {
+        for (size_t j = 0; j < estimate.dirs[i].nsubdirs; j++)
+            free(estimate.dirs[i].subdirs[j]);
+        free(estimate.dirs[i].subdirs);
+    }
+    free(estimate.dirs);
+
+    if (nwalks == 0) {
+        ERROR(_("Unable to estimate path %s with a budget of %zu "
+                "directories\n"), path, budget);
+        free(walks);
+        return 0;
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    for (size_t i = 0; i < nwalks; i++) {
+        walks[i].entries += root;
+        walks[i].compliant += root_compliant;
+        walks[i].ops += root * 2;
+        sum.dirs += walks[i].dirs;
+        sum.entries += walks[i].entries;
+        sum.compliant += walks[i].compliant;
+        sum.ops += walks[i].ops;
+    }
+    latency = estimate.ops ? (double) estimate.ops_ns / estimate.ops : 0;
+    mean_e = sum.entries / nwalks;
+    mean_t = sum.ops / nwalks * latency / 1e9 / jobs;
+    f = sum.entries ? sum.compliant / sum.entries : 1;
+
+    /* sample variances of the means, ratio estimator for the fraction */
+    for (size_t i = 0; nwalks > 1 && i < nwalks; i++) {
+        double t = walks[i].ops * latency / 1e9 / jobs;
+        double r = walks[i].compliant - f * walks[i].entries;
+
+        var_e += (walks[i].entries - mean_e) * (walks[i].entries - mean_e);
+        var_t += (t - mean_t) * (t - mean_t);
+        var_f += r * r;
+    }
+    if (nwalks > 1) {
+        var_e /= (double) (nwalks - 1) * nwalks;
+        var_t /= (double) (nwalks - 1) * nwalks;
+        var_f /= (double) (nwalks - 1) * nwalks * mean_e * mean_e;
+    }
+
+    if (output_format == OUTPUT_NDJSON) {
+        char *json = xmalloc(strlen(real_dir) * 6 + 3);
+
+        *output_json_string(json, real_dir) = '\0';
+        printf("{\"type\":\"estimate\",\"path\":%s,\"walks\":%zu,"
+               "\"directories_read\":%zu,\"jobs\":%d,\"latency_ns\":%.0f",
+               json, nwalks, estimate.ndirs, jobs, latency);
+        free(json);
+    } else {
+        printf(_("Estimate of %s from %zu random walks reading %zu "
+                 "directories:\n"), real_dir, nwalks, estimate.ndirs);
+    }
+    estimate_print("entries", mean_e, ESTIMATE_Z * sqrt(var_e), root,
+                   INFINITY, _("  entries: %.0f (95%% confidence interval: "
+                               "%.0f to %.0f)\n"));
+    if (output_format == OUTPUT_NDJSON)
+        estimate_print("compliant_fraction", f, ESTIMATE_Z * sqrt(var_f), 0,
+                       1, NULL);
+    else
+        estimate_print(NULL, f * 100, ESTIMATE_Z * sqrt(var_f) * 100, 0,
+                       100, _("  compliant entries: %.1f%% (95%% confidence "
+                              "interval: %.1f%% to %.1f%%)\n"));
+    if (output_format != OUTPUT_NDJSON)
+        printf(_("  runtime with %d jobs at %.1f us per metadata operation:"
+                 "\n"), jobs, latency / 1e3);
+    estimate_print("runtime_seconds", mean_t, ESTIMATE_Z * sqrt(var_t), 0,
+                   INFINITY, _("    %.3g s (95%% confidence interval: %.3g s "
+                               "to %.3g s)\n"));
+    if (output_format == OUTPUT_NDJSON)
+        printf("}\n");
+    free(walks);
+    return 0;
+}
+
+/**********************************************************
+ *                                                        *
+ *                   Library interface                    *
+ *                                                        *
+ **********************************************************/
+
+/*
+ * Authorization context of a user, whose identity becomes the current one
+ * during the calls.
+ */
+struct prown_auth {
+    uid_t uid;
+    struct identity *identity;
+};
+
+/*
+ * The library shares the state of prown command (current owner and identity,
+ * options, caches), calls from concurrent threads are serialized.
+ */
+static pthread_mutex_t library_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *prown_strerror(int error) {
+    switch (error) {
+    case PROWN_OK:
+        return _("Success");
+    case PROWN_ERROR_INVALID:
+        return _("Invalid argument");
+    case PROWN_ERROR_CONFIG:
+        return _("Configuration cannot be loaded");
+    case PROWN_ERROR_NOT_FOUND:
+        return _("Path not found");
+    case PROWN_ERROR_OUTSIDE:
+        return _("Path outside project parent directories");
+    case PROWN_ERROR_DENIED:
+        return _("User is not a member of project administrator groups");
+    case PROWN_ERROR_PARTIAL:
+        return _("Some directories could not be processed");
+    case PROWN_ERROR_ABORTED:
+        return _("Walk aborted");
+    case PROWN_ERROR_SYSTEM:
+        return _("System call failed");
+    }
+    return _("Unknown error");
+}
+
+/*
+ * Load configuration file if not already loaded, with library_lock held.
+ */
+static int load_config(const char *filename) {
+    if (config.loaded)
+        return PROWN_OK;
+    if (read_config_file(filename ? filename : CONFIG_FILE))
+        return PROWN_ERROR_CONFIG;
+    return PROWN_OK;
+}
+
+int prown_load_config(const char *filename) {
+    int rc;
+
+    pthread_mutex_lock(&library_lock);
+    rc = load_config(filename);
+    pthread_mutex_unlock(&library_lock);
+    return rc;
+}
+
+struct prown_auth *prown_auth_new(uid_t uid) {
+    struct identity *id;
+    struct prown_auth *auth;
+
+    pthread_mutex_lock(&library_lock);
+    id = resolve_identity(uid);
+    pthread_mutex_unlock(&library_lock);
+    if (id == NULL)
+        return NULL;
+    auth = xmalloc(sizeof(struct prown_auth));
+    auth->uid = uid;
+    auth->identity = id;
+    return auth;
+}
+
+void prown_auth_free(struct prown_auth *auth) {
+    if (auth == NULL)
+        return;
+    free_identity(auth->identity);
+    free(auth);
+}
+
+/*
+ * Resolve real_dir and project_root of path as resolve_project() does, with
+ * the identity of auth as current identity, and check this user is
+ * administrator of the project. The configuration is loaded if required.
+ * Called with library_lock held, the caller resets the current identity.
+ *
+ * Returns PROWN_OK or the error code.
+ */
+static int auth_resolve(struct prown_auth *auth, const char *path,
+                        char *real_dir, char *project_root) {
+    char project_parent[PATH_MAX];
+    int granted;
+
+    if (auth == NULL || path == NULL)
+        return PROWN_ERROR_INVALID;
+    if (load_config(NULL))
+        return PROWN_ERROR_CONFIG;
+    owner = auth->uid;
+    identity = auth->identity;
+
+    if (!realpath(path, real_dir))
+        return PROWN_ERROR_NOT_FOUND;
+    memset(project_parent, 0, PATH_MAX);
+    if (!is_in_projects_parents(project_parent, real_dir))
+        return PROWN_ERROR_OUTSIDE;
+    memset(project_root, 0, PATH_MAX);
+    get_project_root(project_parent, real_dir, project_root);
+    if ((granted = check_project_admin(project_root)) == -1)
+        return PROWN_ERROR_SYSTEM;
+    if (!granted)
+        return PROWN_ERROR_DENIED;
+    return PROWN_OK;
+}
+
+int prown_auth_check(struct prown_auth *auth, const char *path,
+                     char *project_root, size_t size) {
+    char real_dir[PATH_MAX], root[PATH_MAX];
+    int rc;
+
+    pthread_mutex_lock(&library_lock);
+    rc = auth_resolve(auth, path, real_dir, root);
+    identity = NULL;
+    pthread_mutex_unlock(&library_lock);
+    if (rc == PROWN_OK && project_root)
+        strlcpy(project_root, root, size);
+    return rc;
+}
+
+void prown_options_init(struct prown_options *opts) {
+    memset(opts, 0, sizeof(struct prown_options));
+    opts->jobs = 1;
+    opts->recurse = 1;
+}
+
+int prown_walk(struct prown_auth *auth, const char *path,
+               const struct prown_options *opts, prown_walk_cb callback,
+               void *arg) {
+    struct prown_options defaults;
+    char real_dir[PATH_MAX], project_root[PATH_MAX];
+    int rc;
+
+    if (opts == NULL) {
+        prown_options_init(&defaults);
+        opts = &defaults;
+    }
+    if (opts->jobs < 1 || opts->jobs > MAXJOBS || opts->max_fds < 0
+        || opts->max_ops < 0 || opts->max_ops > 1000000000L)
+        return PROWN_ERROR_INVALID;
+
+    pthread_mutex_lock(&library_lock);
+    quiet = opts->quiet;
+    if ((rc = auth_resolve(auth, path, real_dir, project_root)))
+        goto end;
+
+    jobs = opts->jobs;
+    recurse = opts->recurse;
+    one_file_system = opts->one_file_system;
+    inode_order = opts->inode_order;
+    fd_budget = opts->max_fds;
+    governor_init(opts->max_ops, 0);
+    walk_callback = callback;
+    walk_callback_arg = arg;
+    rc = prownPath(real_dir, project_root);
+    walk_callback = NULL;
+    walk_callback_arg = NULL;
+    visited_clear();
+    if (rc == -1)
+        rc = PROWN_ERROR_ABORTED;
+    else if (rc)
+        rc = PROWN_ERROR_PARTIAL;
+
+  end:
+    identity = NULL;
+    pthread_mutex_unlock(&library_lock);
+    return rc;
+}
@@ -0,0 +1,157 @@
+/*
+ * Prown is a simple tool developed to give users the possibility to
+ * own projects (files and repositories).
+ * Copyright (C) 2021 EDF SA.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * libprown gives services (web portals, schedulers, etc.) the ability to take
+ * ownership of project paths on behalf of users, with the same configuration
+ * and authorization rules as prown command:
+ *
+ *   prown_load_config(NULL);
+ *   auth = prown_auth_new(uid);
+ *   prown_walk(auth, path, NULL, callback, arg);
+ *   prown_auth_free(auth);
+ *
+ * The configuration is loaded once per process and the authorization context
+ * of a user can be reused for any number of checks and walks. The process
+ * must be allowed to change owner of files, ie. run as root or with
+ * CAP_CHOWN capability.
+ *
+ * The functions may be called from any thread, but calls are serialized: a
+ * walk blocks the other calls until it is finished. Callbacks are called from
+ * the walker threads, concurrently when more than one job is configured, and
+ * must not call the library. The groups of a user are resolved once when its
+ * authorization context is created, create a new one to take changes of
+ * groups into account. ACLs of project directories are read again when they
+ * are modified. Errors are returned as codes, only failures to allocate
+ * memory or to create threads terminate the process.
+ */
+
+#ifndef LIBPROWN_H
+#define LIBPROWN_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* codes returned by library functions, negative on error */
+enum prown_error {
+    PROWN_OK = 0,
+    PROWN_ERROR_INVALID = -1,   /* invalid argument */
+    PROWN_ERROR_CONFIG = -2,    /* configuration cannot be loaded */
+    PROWN_ERROR_NOT_FOUND = -3, /* path not found */
+    PROWN_ERROR_OUTSIDE = -4,   /* path outside project parent directories */
+    PROWN_ERROR_DENIED = -5,    /* user not administrator of the project */
+    PROWN_ERROR_PARTIAL = -6,   /* some directories could not be walked */
+    PROWN_ERROR_ABORTED = -7,   /* walk aborted on error or by callback */
+    PROWN_ERROR_SYSTEM = -8     /* system call failed, eg. stat() */
+};
+
+/* action performed on a walked entry */
+enum prown_action {
+    PROWN_COMPLIANT,            /* owner and mode already compliant */
+    PROWN_CHANGED,              /* owner or mode changed */
+    PROWN_SKIPPED,              /* other filesystem, loop or hard link */
+    PROWN_FAILED                /* error, see error field */
+};
+
+/* result of the processing of an entry, given to walk callback */
+struct prown_entry {
+    const char *path;           /* absolute path of the entry */
+    dev_t dev;
+    ino_t ino;
+    uid_t old_uid;              /* owner and mode before processing */
+    mode_t old_mode;
+    uid_t new_uid;              /* owner and mode after processing */
+    mode_t new_mode;
+    enum prown_action action;
+    int error;                  /* errno of the failure, 0 otherwise */
+};
+
+/* options of walks, see prown_options_init() for the defaults */
+struct prown_options {
+    int jobs;                   /* number of walker threads, 1 to 256 */
+    int recurse;                /* walk directories recursively */
+    int one_file_system;        /* skip directories on other filesystems */
+    int inode_order;            /* process entries sorted by inode numbers */
+    int max_fds;                /* directories kept open, 0 for default */
+    long max_ops;               /* metadata operations/s, 0 if unlimited */
+    int quiet;                  /* do not print error messages on stderr */
+};
+
+/*
+ * Callback called with the result of each entry processed by a walk, with
+ * arg given to prown_walk(). The entry is only valid during the call.
+ * Returning non-zero aborts the walk.
+ */
+typedef int (*prown_walk_cb)(const struct prown_entry *entry, void *arg);
+
+/* authorization context of a user */
+struct prown_auth;
+
+/*
+ * Returns the message describing error code.
+ */
+const char *prown_strerror(int error);
+
+/*
+ * Load configuration file, /etc/prown.conf if filename is NULL. The
+ * configuration is loaded once, following calls do nothing.
+ *
+ * Returns PROWN_OK or PROWN_ERROR_CONFIG.
+ */
+int prown_load_config(const char *filename);
+
+/*
+ * Returns the authorization context of user uid, with its groups resolved
+ * once, or NULL if the user cannot be resolved.
+ */
+struct prown_auth *prown_auth_new(uid_t uid);
+
+void prown_auth_free(struct prown_auth *auth);
+
+/*
+ * Check the user of authorization context auth is granted to take ownership
+ * of path. If project_root is not NULL, the root directory of the project of
+ * path is copied in this buffer of size bytes.
+ *
+ * Returns PROWN_OK if granted or the error code.
+ */
+int prown_auth_check(struct prown_auth *auth, const char *path,
+                     char *project_root, size_t size);
+
+void prown_options_init(struct prown_options *opts);
+
+/*
+ * Give the user of authorization context auth ownership of path, and of all
+ * entries under path if it is a directory and recursion is enabled, with
+ * options opts (the defaults if NULL). If callback is not NULL, it is called
+ * with the result of each entry.
+ *
+ * Returns PROWN_OK if all entries have been processed or the error code.
+ */
+int prown_walk(struct prown_auth *auth, const char *path,
+               const struct prown_options *opts, prown_walk_cb callback,
+               void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -16,571 +16,486 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+#include <sys/prctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
 #include <bsd/string.h>
-#include <limits.h>
 #include <ctype.h>
-#include <dirent.h>
-#include <pwd.h>
 #include <error.h>
+#include <errno.h>
 #include <getopt.h>
 #include <grp.h>
-#include <errno.h>
-#include <stdbool.h>
 #include <libintl.h>
 #include <locale.h>
-#include <acl/libacl.h>
-
-#define MAXLINE  1000
-#define _(STRING) gettext(STRING)
-
-#define VERBOSE(fmt, ...) if(!verbose); else printf(fmt, ## __VA_ARGS__)
-#define ERROR(fmt, ...) \
-        do { fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
-
-
-/* static variable for verbose mode */
-static int verbose;
-
-/* number of project paths in config file */
-static int nop = 0;
-
-/* number of authorized groups in config file
- * and associated string array
- * */
-static int noag = 0;
-static char *authorized_groups[PATH_MAX];
-
-/* static variable to activate or not recursion */
-static int recurse = 1;
-
-/**********************************************************
- *                                                        *
- *                  Configuration load                    *
- *                                                        *
- **********************************************************/
-
-/*
- * Read lines from config file.
- * */
-void read_str_from_config_line(char *config_line, char *val) {
-    char prm_name[MAXLINE];
+#include <signal.h>
+#include <stdint.h>
+#include <linux/capability.h>
 
-    sscanf(config_line, "%s %s\n", prm_name, val);
-}
+#include "libprown.h"
+#include "prown.h"
 
-/*
- * Read config file. projects_parents is the lis of projects
- * */
-void read_config_file(char config_filename[], char *projects_parents[],
-                      char *authorized_groups[]) {
-    FILE *fp;
-    char buf[MAXLINE];
-
-    if ((fp = fopen(config_filename, "r")) == NULL) {
-        ERROR(_("Failed to open configuration file %s\n"), config_filename);
-        exit(EXIT_FAILURE);
-    }
-    while (!feof(fp)) {
-        char *rc = fgets(buf, MAXLINE, fp);
-
-        if (!feof(fp) && rc == NULL) {
-            ERROR(_("Unable to read configuration file %s\n"),
-                  config_filename);
-            exit(EXIT_FAILURE);
-        }
-        if (buf[0] == '#' || strlen(buf) < 4) {
-            continue;
-        }
-        if (strstr(buf, "PROJECT_DIR ")) {
-            if ((projects_parents[nop] =
-                 malloc(sizeof(char) * PATH_MAX)) == NULL) {
-                ERROR(_
-                      ("Unable to allocate memory for loading "
-                       "configuration file parameters\n"));
-                exit(1);
-            }
-            read_str_from_config_line(buf, projects_parents[nop]);
-            nop++;
-        } else if (strstr(buf, "AUTHORIZED_GROUP ")) {
-            if ((authorized_groups[noag] =
-                 malloc(sizeof(char) * PATH_MAX)) == NULL) {
-                ERROR(_
-                      ("Unable to allocate memory for loading "
-                       "configuration file parameters\n"));
-                exit(1);
-            }
-            read_str_from_config_line(buf, authorized_groups[noag]);
-            noag++;
-        }
-    }
-    fclose(fp);
-}
+int prown(int argc, char **argv);
 
 /**********************************************************
  *                                                        *
- *                      Helpers                           *
+ *                        Daemon                          *
  *                                                        *
  **********************************************************/
 
-
 /*
- * Returns true if user is member of authorized group whose gid is in a
- * argument, false otherwise.
+ * prownd is a long-running service started as root, which keeps the
+ * configuration and the identities of users loaded. When prownd is running,
+ * prown forwards its arguments through a Unix socket along with its standard
+ * file descriptors and its current directory. For each request, prownd
+ * authenticates the client with SO_PEERCRED and forks a child process which
+ * takes the identity of the client, only keeping CAP_CHOWN capability, and
+ * processes the arguments exactly as prown does. The child sends its pid, so
+ * the client can forward signals, and finally its exit status.
+ *
+ * Request format is:
+ *
+ *   <length>
+ *   <environment variable>\0
+ *   …
+ *   \0
+ *   <argument>\0
+ *   …
+ *
+ * with the length of the following data on 32 bits, sent with the file
+ * descriptors of the client standard input, output, error and current
+ * directory, then the locale environment variables of the client and its
+ * arguments.
  */
-bool is_user_in_authorized_group(int idx, char * user, int ngroups, __gid_t * groups) {
 
-    struct group *gr;
-    char *agroup;
+#define PROWND "prownd"
+#define PROWND_SOCKET "/run/prownd.sock"
+#define PROWND_MAX_REQUEST (4 << 20)
+#define PROWND_NFDS 4
+#define PROWND_IDENTITY_TTL 60
 
-    agroup = authorized_groups[idx];
-    gr = getgrnam(agroup);
+enum prownd_message_type {
+    PROWND_PID,                 /* pid of the child processing the request */
+    PROWND_EXIT                 /* exit status of the request */
+};
 
-    if (gr == NULL) {
-        VERBOSE(_("Authorized group name %s don't exist!\n"), agroup);
-        VERBOSE(_
-                ("We assume User can't be a valid member of unexistent group!\n"));
-        return false;
-    }
+struct prownd_message {
+    int32_t type;
+    int32_t value;
+};
 
-    for (int i = 0; i < ngroups; i++) {
-        if (gr->gr_gid == groups[i]) {
-            VERBOSE(_("User is a valid member of authorized group %s (%d)\n"),
-                    agroup, groups[i]);
-            return true;
-        }
-    }
+static volatile sig_atomic_t prownd_child;
 
-    VERBOSE(_("User %s is NOT a valid member of authorized group %s (%d)\n"),
-            user, agroup, gr->gr_gid);
-
-    return false;
+static bool is_locale_variable(const char *var) {
+    return strncmp(var, "LC_", 3) == 0 || strncmp(var, "LANG=", 5) == 0
+        || strncmp(var, "LANGUAGE=", 9) == 0;
 }
 
-/*
- * Returns true if user is member of group whose gid is in a
- * argument, false otherwise.
- */
-bool is_user_in_group(gid_t gid) {
-
-    struct passwd *pw;
-    int ngroups = 0;
-
-    pw = getpwuid(getuid());
-
-    if (pw == NULL) {
-        perror(_("Error on getpwuid(): "));
-    }
-    //this call is just to get the correct ngroups
-    getgrouplist(pw->pw_name, pw->pw_gid, NULL, &ngroups);
-    __gid_t groups[ngroups];
-
-    //here we actually get the groups
-    getgrouplist(pw->pw_name, pw->pw_gid, groups, &ngroups);
-
-    int count = 0;
-
-    if (!noag) {
-        // skip if no authorized group provided!
-        // assuming default to all rw group are authorized!
-        count = 1;
-    }
-    /* Start checking if User is a valid member of any authorized group!
-     * scanning the list of groups the user belongs to
-     * stop scanning at noag-1 as authorized array have one more entry!
-     * */
-    for (int i = 0; i < noag-1; i++) {
-        if (is_user_in_authorized_group(i, pw->pw_name, ngroups, groups)) {
-            ++count;
-            break;
-        }
-    }
-    //printf("ngroups: %d, noag: %d count: %d\n", ngroups, noag, count);
-
-    if (!count) {
-        VERBOSE(_("User is NOT a valid member of any authorized group!\n"));
-        return false;
-    }
-
-    for (int i = 0; i < ngroups; i++) {
-        if (groups[i] == gid) {
-            VERBOSE(_("User is a valid member of group %s (%d)\n"),
-                    getgrgid(gid)->gr_name, gid);
-            return true;
-        }
-    }
-    VERBOSE(_("User is NOT a valid member of group %s (%d)\n"),
-            getgrgid(gid)->gr_name, gid);
-    return false;
+static void prownd_forward_signal(int signum) {
+    if (prownd_child > 0)
+        kill(prownd_child, signum);
 }
 
 /*
- * Returns true if path is under one of the given projects_parents. If true,
- * project_parent string is set with the matching projects_parents.
+ * Forward the request to prownd if it is running and wait for the end of its
+ * processing.
  *
- * The project_parent argument must be a preallocated string.
- *
- * Examples:
- *
- *   With:
- *
- *     projects_parents = { '/projects', '/data' }
- *     path = '/projects/awesome/data'
- *
- *     → is_in_projects_parents() returs true and set project_parent to '/projects'.
- *
- *   With:
- *
- *     projects_parentts = { '/projects', '/data' }
- *     path = '/tmp/file'
- *
- *     → is_in_projects_parents() returns false (project_parent is not modified).
+ * Returns the exit status of the request, or -1 if prownd is not running.
  */
-
-bool is_in_projects_parents(char **projects_parents, char *project_parent,
-                            const char *path) {
-
-    for (int i = 0; i < nop; i++) {
-        int l = strlen(projects_parents[i]);
-
-        //if file in list of projects but not equal the project
-        if ((strncmp(path, projects_parents[i], l) == 0)
-            && (strcmp(path, projects_parents[i]))) {
-            strncpy(project_parent, projects_parents[i], PATH_MAX);
-            return true;
+int prownd_request(int argc, char **argv) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX };
+    int fds[PROWND_NFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct prownd_message msg;
+    struct sigaction sa;
+    uint32_t length = 1;
+    char *request, *p;
+    int sock, signums[] = { SIGINT, SIGTERM, SIGHUP, SIGUSR1 };
+
+    strlcpy(addr.sun_path, PROWND_SOCKET, sizeof(addr.sun_path));
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(sock);
+        return -1;
+    }
+
+    /* standard streams may be closed, give /dev/null instead */
+    for (int i = 0; i < PROWND_NFDS - 1; i++)
+        if (fcntl(fds[i], F_GETFD) == -1)
+            fds[i] = open("/dev/null", O_RDWR | O_CLOEXEC);
+    fds[PROWND_NFDS - 1] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    for (int i = 0; i < PROWND_NFDS; i++)
+        if (fds[i] == -1) {
+            ERROR(_("Unable to send request to %s: %s\n"), PROWND,
+                  strerror(errno));
+            return EXIT_FAILURE;
         }
-    }
 
-    return false;
+    for (char **var = environ; *var; var++)
+        if (is_locale_variable(*var))
+            length += strlen(*var) + 1;
+    for (int i = 0; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+    p = request = xmalloc(length);
+    for (char **var = environ; *var; var++)
+        if (is_locale_variable(*var))
+            p = stpcpy(p, *var) + 1;
+    *p++ = '\0';
+    for (int i = 0; i < argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &length;
+    iov.iov_len = sizeof(length);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &mh, 0) != sizeof(length)
+        || write_full(sock, request, length)) {
+        ERROR(_("Unable to send request to %s: %s\n"), PROWND,
+              strerror(errno));
+        return EXIT_FAILURE;
+    }
+    free(request);
+    close(fds[PROWND_NFDS - 1]);
+
+    /* signals are forwarded to the child processing the request */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prownd_forward_signal;
+    sa.sa_flags = SA_RESTART;
+    for (size_t i = 0; i < sizeof(signums) / sizeof(int); i++)
+        sigaction(signums[i], &sa, NULL);
+
+    while (read_full(sock, &msg, sizeof(msg)) == 0) {
+        if (msg.type == PROWND_PID)
+            prownd_child = msg.value;
+        else if (msg.type == PROWND_EXIT)
+            return msg.value;
+    }
+    ERROR(_("Connection to %s closed unexpectedly\n"), PROWND);
+    return EXIT_FAILURE;
 }
 
 /*
- * Set project_root with the path of the root directory of the project
- * located under project_parent and containing the path in argument.
- *
- * Example:
- *
- *    With:
- *
- *      project_parent = '/projects'
- *      path = '/projects/awesome/path/to/file'
- *
- *    → project_root is '/projects/awesome'
+ * The service is only built in prownd program, which is started by root. It
+ * is not reachable from prown, installed with CAP_CHOWN capability.
  */
+#ifdef PROWN_DAEMON
 
-void get_project_root(char *project_parent, char *path, char *project_root) {
+/* identity of a client, resolved again when expired */
+struct prownd_user {
+    uid_t uid;
+    struct identity *identity;
+    long long expires;
+};
 
-    // get the path of project
-    int l = strlen(project_parent);
-    int h = l + 1;
-
-    /* clean allocated memory for strings */
-    memset(project_root, 0, PATH_MAX);
-
-    while (path[h] != '\0' && path[h] != '/') {
-        h++;
-    }
-    strcpy(project_root, project_parent);
-    /* concat with the basename of project directory */
-    strncat(project_root, &path[l], h - l);
-
-    VERBOSE(_("Project path: %s\n"), project_root);
-
-}
+static struct prownd_user *prownd_users;
+static size_t nprownd_users;
+static volatile sig_atomic_t prownd_stop;
 
 /*
- * Returns true if ACL entry is of type group, false otherwise.
+ * Check locale variable var of a client can be set in the child processing
+ * its request. This child is not executed, so the C library does not apply
+ * the restrictions of secure mode: paths in values would load locales or
+ * messages catalogs chosen by the client in a process with CAP_CHOWN. Only
+ * locales installed on the system are accepted, and LANGUAGE list of
+ * catalogs names must not contain paths.
  */
+static bool is_valid_locale_variable(const char *var) {
+    const char *value = strchr(var, '=');
+    locale_t locale;
 
-bool check_acl_is_group(acl_entry_t ent) {
-
-    acl_tag_t e_type;
-
-    if (acl_get_tag_type(ent, &e_type) == -1) {
-        perror(_("Error on acl_get_tag_type()"));
+    if (!is_locale_variable(var) || value == NULL || strchr(++value, '/'))
         return false;
-    }
+    if (strncmp(var, "LANGUAGE=", 9) == 0 || *value == '\0')
+        return true;
+    locale = newlocale(LC_ALL_MASK, value, (locale_t) 0);
+    if (locale == (locale_t) 0)
+        return false;
+    freelocale(locale);
+    return true;
+}
 
-    return (e_type == ACL_GROUP);
+static int cmp_prownd_user(const void *a, const void *b) {
+    uid_t ua = ((const struct prownd_user *) a)->uid;
+    uid_t ub = ((const struct prownd_user *) b)->uid;
 
+    return (ua > ub) - (ua < ub);
 }
 
 /*
- * Returns true if ACL entry has write permission, false otherwise.
+ * Returns the identity of user uid, resolved with NSS if it is not known or
+ * expired, or NULL if it cannot be resolved.
  */
-
-bool check_acl_can_write(acl_entry_t ent) {
-
-    acl_permset_t e_permset;
-    int perm;
-
-    if (acl_get_permset(ent, &e_permset) == -1) {
-        perror(_("Error on acl_get_permset()"));
-        return false;
-    }
-
-    perm = acl_get_perm(e_permset, ACL_WRITE);
-
-    if (perm == -1) {
-        perror(_("Error on acl_get_perm()"));
-        return false;
-    }
-
-    return (perm == 1);
+static struct identity *prownd_identity(uid_t uid) {
+    struct prownd_user key = {.uid = uid }, *user;
+    long long now = monotonic_time();
+
+    user = bsearch(&key, prownd_users, nprownd_users,
+                   sizeof(struct prownd_user), cmp_prownd_user);
+    if (user && user->expires > now)
+        return user->identity;
+    if (user == NULL) {
+        size_t pos = 0;
+
+        while (pos < nprownd_users && prownd_users[pos].uid < uid)
+            pos++;
+        prownd_users = xrealloc(prownd_users, (nprownd_users + 1) *
+                                sizeof(struct prownd_user));
+        memmove(&prownd_users[pos + 1], &prownd_users[pos],
+                (nprownd_users - pos) * sizeof(struct prownd_user));
+        nprownd_users++;
+        user = &prownd_users[pos];
+        user->uid = uid;
+    } else {
+        free_identity(user->identity);
+    }
+    user->identity = resolve_identity(uid);
+    user->expires = now + PROWND_IDENTITY_TTL;
+    if (user->identity == NULL) {
+        /* not cached, it is resolved again on next request */
+        nprownd_users--;
+        memmove(user, user + 1, (nprownd_users - (user - prownd_users)) *
+                sizeof(struct prownd_user));
+        return NULL;
+    }
+    return user->identity;
 }
 
 /*
- * Returns true if current user is member ACL entry GID (considering it is has
- * group type, and must be checked before call this function), false otherwise.
+ * Send exit status of the request to the client, once all output is flushed.
  */
+static void prownd_exit_status(int status, void *arg) {
+    struct prownd_message msg = {.type = PROWND_EXIT,.value = status };
 
-bool check_acl_user_in_group(acl_entry_t ent) {
-
-    gid_t *id_p = acl_get_qualifier(ent);
-
-    if (!id_p) {
-        perror(_("Error on acl_get_qualifier()"));
-        return false;
-    }
-
-    return is_user_in_group(*id_p);
+    fflush(NULL);
+    write_full((int) (intptr_t) arg, &msg, sizeof(msg));
 }
 
-
 /*
- * Returns true if the ACL entry fulfills all requirements:
- *  - it has the group type
- *  - it has the write permission
- *  - the current user is member of this group
+ * Take the identity of the client, with its groups resolved with NSS and
+ * only CAP_CHOWN capability.
  *
- * It returns false if any of the above is false, or if any rerror is
- * encountered.
+ * Returns 0 on success, -1 otherwise with errno set.
  */
-
-bool check_acl_entry(acl_entry_t ent) {
-
-    if (!check_acl_is_group(ent)) {
-        return false;
-    }
-
-    if (!check_acl_can_write(ent)) {
-        return false;
-    }
-
-    return check_acl_user_in_group(ent);
-
+static int prownd_set_credentials(const struct ucred *cred,
+                                  const struct identity *id) {
+    struct __user_cap_header_struct header = {
+        .version = _LINUX_CAPABILITY_VERSION_3,
+        .pid = 0
+    };
+    struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+
+    memset(data, 0, sizeof(data));
+    data[0].effective = data[0].permitted = 1 << CAP_CHOWN;
+    if (setgroups(id->ngroups, id->groups)
+        || setresgid(cred->gid, cred->gid, cred->gid)
+        || prctl(PR_SET_KEEPCAPS, 1)
+        || setresuid(cred->uid, cred->uid, cred->uid)
+        || syscall(SYS_capset, &header, data))
+        return -1;
+    return 0;
 }
 
 /*
- * Returns true if the current user is a valid administrator of the project,
- * ie. she/he is a member of the project group owner of the project root
- * directory.
+ * Process the request of the client connected on sock, in a child process of
+ * prownd. Never returns.
  */
+static void prownd_serve(int sock, const struct ucred *cred,
+                         struct identity *id) {
+    int fds[PROWND_NFDS];
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct prownd_message msg = {.type = PROWND_PID,.value = getpid() };
+    uint32_t length;
+    char *request, *p, *end, **argv;
+    int argc = 0;
+
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &length;
+    iov.iov_len = sizeof(length);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != sizeof(length)
+        || (cmsg = CMSG_FIRSTHDR(&mh)) == NULL
+        || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))
+        || length == 0 || length > PROWND_MAX_REQUEST)
+        goto invalid;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    request = xmalloc(length);
+    if (read_full(sock, request, length) || request[length - 1] != '\0')
+        goto invalid;
+
+    if (prownd_set_credentials(cred, id)) {
+        ERROR(_("Unable to set credentials of user %u: %s\n"), cred->uid,
+              strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    /* environment of the client until an empty string, minus bad locales */
+    clearenv();
+    end = request + length;
+    for (p = request; p < end && *p; p += strlen(p) + 1)
+        if (is_valid_locale_variable(p))
+            putenv(p);
+    if (p == end)
+        goto invalid;
+    p++;
+    argv = xmalloc((length + 1) * sizeof(char *));
+    for (; p < end; p += strlen(p) + 1)
+        argv[argc++] = p;
+    argv[argc] = NULL;
+    if (argc == 0)
+        goto invalid;
+
+    /* the client streams and directory replace those of prownd */
+    for (int i = 0; i < PROWND_NFDS - 1; i++)
+        if (dup2(fds[i], i) == -1)
+            _exit(EXIT_FAILURE);
+    if (fchdir(fds[PROWND_NFDS - 1]))
+        _exit(EXIT_FAILURE);
+    for (int i = 0; i < PROWND_NFDS; i++)
+        close(fds[i]);
+    program_invocation_name = argv[0];
+    program_invocation_short_name = basename(argv[0]);
+    setlocale(LC_ALL, "");
 
-bool is_user_project_admin(const char *project_root) {
-
-    struct stat sb;
-    bool is_admin = false;      /* return value */
-    acl_t acl;
-    acl_entry_t ent;
-    int ret;
-
-    /* Get gid of group owner of project root directory */
-    if (stat(project_root, &sb) == -1) {
-        perror(_("Error on stat()"));
-        exit(EXIT_FAILURE);
-    }
-
-    VERBOSE(_("Project group owner: %s (%d)\n"), getgrgid(sb.st_gid)->gr_name,
-            sb.st_gid);
-
-    /* Return true if user is member of group owner of project root directory */
-    if (is_user_in_group(sb.st_gid)) {
-        return true;
-    }
-
-    VERBOSE(_("Checking ACL\n"));
-
-    acl = acl_get_file(project_root, ACL_TYPE_ACCESS);
-
-    if (acl == NULL) {
-        perror(_("Error on acl_get_file()"));
-        return false;
-    }
-
-    ret = acl_get_entry(acl, ACL_FIRST_ENTRY, &ent);
-
-    if (ret == -1) {
-        perror(_("Error on acl_get_entry()"));
-        goto end;
-    }
+    if (write_full(sock, &msg, sizeof(msg)))
+        _exit(EXIT_FAILURE);
+    on_exit(prownd_exit_status, (void *) (intptr_t) sock);
 
-    if (ret == 0) {
-        VERBOSE(_("No ACL entries available\n"));
-        goto end;
-    }
-
-    while (ret > 0) {
-        if (check_acl_entry(ent)) {
-            is_admin = true;
-            goto end;
-        }
-        ret = acl_get_entry(acl, ACL_NEXT_ENTRY, &ent);
-    }
-
-  end:
-    acl_free(acl);
-    return is_admin;
+    owner = cred->uid;
+    identity = id;
+    optind = 0;
+    exit(prown(argc, argv));
 
+  invalid:
+    ERROR(_("Invalid request from user %u\n"), cred->uid);
+    _exit(EXIT_FAILURE);
 }
 
-/**********************************************************
- *                                                        *
- *             Workflow processing functions              *
- *                                                        *
- **********************************************************/
-
-/*set user as the owner of the current file or directory*/
-void setOwner(const char *path) {
-    //use lchown to change owner for symlinks
-    VERBOSE(_("Changing owner of path %s\n"), path);
-    if (lchown(path, getuid(), (gid_t) - 1) != 0) {
-        perror(_("Error on chown(): "));
-        exit(EXIT_FAILURE);
-    }
-    //set rw to group if its not a symlink
-    struct stat buf;
-
-    if (lstat(path, &buf)) {
-        perror(_("Error on lstat()"));
-        exit(EXIT_FAILURE);
-    }
+static void prownd_terminate(int signum) {
+    (void) signum;
+    prownd_stop = 1;
+}
 
-    if (!S_ISLNK(buf.st_mode)) {
-        struct stat st;
+/*
+ * Run prownd service, until SIGTERM or SIGINT is received.
+ */
+int prownd(int argc, char **argv) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX };
+    struct sigaction sa;
+    int lsock;
 
-        VERBOSE(_("Ensuring group owner has rw permissions on path %s\n"),
-                path);
+    setlocale(LC_ALL, "");
+    bindtextdomain("prown", "/usr/share/locale/");
+    textdomain("prown");
 
-        stat(path, &st);
-        if (chmod(path, S_IRGRP | S_IWGRP | st.st_mode) != 0) {
-            perror(_("Error on chmod(): "));
-            exit(EXIT_FAILURE);
+    if (argc > 1) {
+        printf(_("Usage: %s\n"
+                 "Run prown service, processing the requests of prown "
+                 "command received on socket\n%s.\n"), argv[0],
+               PROWND_SOCKET);
+        return strcmp(argv[1], "-h") && strcmp(argv[1], "--help") ?
+            EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (prown_load_config(NULL))
+        return EXIT_FAILURE;
+
+    strlcpy(addr.sun_path, PROWND_SOCKET, sizeof(addr.sun_path));
+    unlink(PROWND_SOCKET);
+    if ((lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+        || bind(lsock, (struct sockaddr *) &addr, sizeof(addr))
+        || chmod(PROWND_SOCKET, 0666) || listen(lsock, SOMAXCONN)) {
+        ERROR(_("Unable to listen on socket %s: %s\n"), PROWND_SOCKET,
+              strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* children are reaped automatically */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prownd_terminate;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    while (!prownd_stop) {
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        struct identity *id;
+        int sock = accept4(lsock, NULL, NULL, SOCK_CLOEXEC);
+        pid_t pid;
+
+        if (sock == -1) {
+            if (errno != EINTR)
+                ERROR(_("Error on accept(): %s\n"), strerror(errno));
+            continue;
         }
-    }
-}
-
-/*
- * set recursively the user as the owner of the project.
- *
- * Returns 0 if valid, 1 otherwise.
- * */
-int projectOwner(char *basepath) {
-    struct stat buf;
-
-    lstat(basepath, &buf);
-    int status = 0;
-
-    if (S_ISDIR(buf.st_mode)) {
-        char path[PATH_MAX];
-        struct dirent *dp;
-        DIR *dir = opendir(basepath);
-
-        // Unable to open directory stream
-        if (!dir) {
-            ERROR(_("Failed to open directory '%s': %s (%d)\n"), basepath,
-                  strerror(errno), errno);
-            return 1;
+        if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+            ERROR(_("Unable to get credentials of client: %s\n"),
+                  strerror(errno));
+            close(sock);
+            continue;
         }
+        if ((id = prownd_identity(cred.uid)) == NULL) {
+            struct prownd_message msg = {.type = PROWND_EXIT,
+                .value = EXIT_FAILURE
+            };
 
-        VERBOSE(_("Changing %sowner of directory %s content\n"),
-                recurse ? "recursively " : "", basepath);
-
-        while ((dp = readdir(dir)) != NULL) {
-            if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0
-                && strcmp(dp->d_name, basepath) != 0) {
-                // Construct new path from our base path
-                if (strlcpy(path, basepath, sizeof(path)) >= sizeof(path))
-                    exit(1);
-                strcat(path, "/");
-                strcat(path, dp->d_name);
-                setOwner(path);
-                if (recurse)
-                    projectOwner(path);
-            }
+            write_full(sock, &msg, sizeof(msg));
+            close(sock);
+            continue;
         }
-        closedir(dir);
-    }
-    return status;
-}
-
-int prownProject(char *path) {
-    char *projects_parents[PATH_MAX];
-    char real_dir[PATH_MAX];
-    bool isInProjectPath;
-    char project_parent[PATH_MAX], project_root[PATH_MAX];
-    struct stat path_stat;
-
-
-    /* clean allocated memory for strings */
-    memset(real_dir, 0, PATH_MAX);
-    memset(project_parent, 0, PATH_MAX);
-    memset(project_root, 0, PATH_MAX);
-
-    read_config_file("/etc/prown.conf", projects_parents, authorized_groups);
-
-    VERBOSE(_("+ Processing path %s\n"), path);
-
-    // check the real path is correct
-    if (!realpath(path, real_dir)) {
-        ERROR(_("Path '%s' has not been found, it is discarded\n"), path);
-        return 0;
-    }
-
-    /* check path is under projects roots directories */
-    isInProjectPath =
-        is_in_projects_parents(projects_parents, project_parent, real_dir);
-
-    if (!isInProjectPath) {
-        ERROR(_("Changing owner of file outside project parent directories "
-                "is prohibited, path '%s' is discarded\n"), path);
-        return 0;
-    }
-
-    /* get project root directory */
-    get_project_root(project_parent, real_dir, project_root);
-
-    /* check user is administrator of this project */
-    if (!is_user_project_admin(project_root)) {
-        ERROR(_("Permission denied for project %s, you are not a member of "
-                "this project administor groups\n"), project_root);
-        return 0;
-    } else
-        VERBOSE(_("User is granted to prown in project directory %s\n"),
-                project_root);
-
-    stat(real_dir, &path_stat);
-    //if it's a file we should call setOwner one time
-    if (path_stat.st_mode & S_IFREG) {
-        setOwner(real_dir);
-    } else {
-        // chown the real_dir if it's not the projectDir
-        // because projectOwner() doesn't chown the entry path
-        // but only the chlids
-        if (strcmp(real_dir, project_root))
-            setOwner(real_dir);
-        if (recurse)
-            projectOwner(real_dir);
+        if ((pid = fork()) == 0) {
+            close(lsock);
+            prownd_serve(sock, &cred, id);
+        }
+        if (pid == -1)
+            ERROR(_("Error on fork(): %s\n"), strerror(errno));
+        close(sock);
     }
 
-    return 0;
+    close(lsock);
+    unlink(PROWND_SOCKET);
+    return EXIT_SUCCESS;
 }
+#endif
 
 /**********************************************************
  *                                                        *
@@ -598,6 +513,63 @@ void usage(int status) {
                  "in this directory recursively or not.\n"
                  "\n"
                  "  -d, --directory        Don't proceed recursively!\n"
+                 "  -x, --one-file-system  Skip directories on different "
+                 "file systems\n"
+                 "      --exclude=PATTERN  Skip entries whose names match "
+                 "PATTERN\n"
+                 "      --max-depth=N      Process entries at most N levels "
+                 "below PATH\n"
+                 "  -j, --jobs=N           Walk directories with N threads "
+                 "(default: 1)\n"
+                 "  -T, --files-from=FILE  Process paths listed in FILE, one "
+                 "per line (- for\n"
+                 "                         standard input)\n"
+                 "  -0, --null             Paths in FILE are separated by NUL "
+                 "characters\n"
+                 "  -c, --checkpoint=FILE  Save progress of recursive walk "
+                 "in FILE\n"
+                 "      --checkpoint-interval=SECONDS\n"
+                 "                         Interval between saves of "
+                 "progress (default: 60)\n"
+                 "      --max-fds=N        Keep at most N directories open "
+                 "during walks\n"
+                 "                         (default: half of open files "
+                 "limit)\n"
+                 "      --inode-order      Process directories entries "
+                 "sorted by inode numbers\n"
+                 "      --max-ops=N        Perform at most N metadata "
+                 "operations per second\n"
+                 "      --target-latency=MS\n"
+                 "                         Reduce threads processing entries "
+                 "when stat latency\n"
+                 "                         exceeds MS milliseconds\n"
+                 "      --shard=I/N        Process only part I of N of "
+                 "project trees\n"
+                 "      --shard-depth=D    Split project trees in parts at "
+                 "depth D (default: 2)\n"
+                 "  -r, --resume=FILE      Resume walk saved in FILE\n"
+                 "  -p, --plan=FILE        Write changes in plan FILE "
+                 "without modifying files\n"
+                 "  -a, --apply=FILE       Apply changes of plan FILE\n"
+                 "      --journal=FILE     Record changes in journal FILE\n"
+                 "      --undo=FILE        Revert changes recorded in journal "
+                 "FILE, previous\n"
+                 "                         owners are only restored by root\n"
+                 "      --incremental=FILE Skip content of directories "
+                 "unchanged since previous\n"
+                 "                         run recorded in index FILE\n"
+                 "      --output=FORMAT    Print results in FORMAT: text "
+                 "(default), ndjson for\n"
+                 "                         one JSON record per changed entry, "
+                 "or summary\n"
+                 "      --estimate[=N]     Estimate size of trees, compliant "
+                 "entries and runtime\n"
+                 "                         by reading at most N directories "
+                 "(default: 1000),\n"
+                 "                         without modifying files\n"
+                 "  -s, --stats[=FILE]     Print statistics in JSON on exit "
+                 "and on SIGUSR1,\n"
+                 "                         on stderr or in FILE\n"
                  "  -v, --verbose          Display modified paths and more "
                  "information\n"
                  "  -h, --help             Display this help and exit\n"
@@ -614,28 +586,67 @@ void usage(int status) {
                  "                         directory recursively\n"
                  "  prown awesome crazy    Take ownership of both awesome "
                  "and crazy\n"
-                 "                         project directories recursively\n"));
+                 "                         project directories recursively\n"
+                 "  prown --estimate awesome\n"
+                 "                         Estimate runtime of taking "
+                 "ownership of awesome\n"
+                 "                         project directory\n"));
     }
 }
 
-int main(int argc, char **argv) {
-    char *options = "dhv";
+/*
+ * Process command line arguments, in prown process or in prownd child process
+ * serving a client request.
+ *
+ * Returns the exit status.
+ */
+int prown(int argc, char **argv) {
+    char *options = "0a:c:dhj:p:r:sT:vx";
     int longindex;
     int opt;
     int help = 0;
+    char *files_from = NULL;
+    char *resume_file = NULL;
+    char *plan_file = NULL;
+    char *apply_file = NULL;
+    char *journal_file = NULL;
+    char *undo_file = NULL;
+    char *incremental_file = NULL;
+    long estimate_budget = 0;
+    int delim = '\n';
+    long max_ops = 0;
+    unsigned long long target_latency = 0;
 
     struct option longopts[] = {
         {"help", no_argument, NULL, 'h'},
         {"verbose", no_argument, NULL, 'v'},
         {"directory", no_argument, NULL, 'd'},
+        {"one-file-system", no_argument, NULL, 'x'},
+        {"exclude", required_argument, NULL, 'E'},
+        {"max-depth", required_argument, NULL, 'K'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"files-from", required_argument, NULL, 'T'},
+        {"null", no_argument, NULL, '0'},
+        {"checkpoint", required_argument, NULL, 'c'},
+        {"checkpoint-interval", required_argument, NULL, 'I'},
+        {"max-fds", required_argument, NULL, 'F'},
+        {"inode-order", no_argument, NULL, 'O'},
+        {"max-ops", required_argument, NULL, 'M'},
+        {"target-latency", required_argument, NULL, 'L'},
+        {"shard", required_argument, NULL, 'S'},
+        {"shard-depth", required_argument, NULL, 'D'},
+        {"resume", required_argument, NULL, 'r'},
+        {"stats", optional_argument, NULL, 's'},
+        {"plan", required_argument, NULL, 'p'},
+        {"apply", required_argument, NULL, 'a'},
+        {"journal", required_argument, NULL, 'J'},
+        {"undo", required_argument, NULL, 'U'},
+        {"incremental", required_argument, NULL, 'N'},
+        {"output", required_argument, NULL, 'W'},
+        {"estimate", optional_argument, NULL, 'G'},
         {NULL, 0, NULL, 0}
     };
 
-    /* Setting the i18n environment */
-    setlocale(LC_ALL, "");
-    bindtextdomain("prown", "/usr/share/locale/");
-    textdomain("prown");
-
     while ((opt =
             getopt_long(argc, argv, options, longopts, &longindex)) != -1) {
         switch (opt) {
@@ -649,19 +660,283 @@ int main(int argc, char **argv) {
         case 'd':
             recurse = 0;
             break;
+        case 'x':
+            one_file_system = 1;
+            break;
+        case 'E':
+            if (exclude_add(optarg)) {
+                error(0, 0, _("Invalid exclude pattern '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'K':
+            max_depth = atoi(optarg);
+            if (max_depth < 0 || !isdigit((unsigned char) *optarg)) {
+                error(0, 0, _("Invalid maximum depth '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1 || jobs > MAXJOBS) {
+                error(0, 0, _("Invalid number of jobs '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            files_from = optarg;
+            break;
+        case '0':
+            delim = '\0';
+            break;
+        case 'c':
+            checkpoint_file = optarg;
+            break;
+        case 'I':
+            checkpoint_interval = atoi(optarg);
+            if (checkpoint_interval < 1) {
+                error(0, 0, _("Invalid checkpoint interval '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            fd_budget = atoi(optarg);
+            if (fd_budget < 1) {
+                error(0, 0, _("Invalid number of file descriptors '%s'"),
+                      optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            inode_order = 1;
+            break;
+        case 'M':
+            max_ops = atol(optarg);
+            if (max_ops < 1 || max_ops > 1000000000L) {
+                error(0, 0, _("Invalid rate of operations '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            if (atoi(optarg) < 1) {
+                error(0, 0, _("Invalid target latency '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            target_latency = atoi(optarg) * 1000000ULL;
+            break;
+        case 'S':
+            if (shard_parse(optarg)) {
+                error(0, 0, _("Invalid shard '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'D':
+            shard.depth = atoi(optarg);
+            if (shard.depth < 1) {
+                error(0, 0, _("Invalid shard depth '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            resume_file = optarg;
+            break;
+        case 's':
+            stats_file = optarg ? optarg : "-";
+            break;
+        case 'p':
+            plan_file = optarg;
+            break;
+        case 'a':
+            apply_file = optarg;
+            break;
+        case 'J':
+            journal_file = optarg;
+            break;
+        case 'U':
+            undo_file = optarg;
+            break;
+        case 'N':
+            incremental_file = optarg;
+            break;
+        case 'W':
+            if (strcmp(optarg, "text") == 0)
+                output_format = OUTPUT_TEXT;
+            else if (strcmp(optarg, "ndjson") == 0)
+                output_format = OUTPUT_NDJSON;
+            else if (strcmp(optarg, "summary") == 0)
+                output_format = OUTPUT_SUMMARY;
+            else {
+                error(0, 0, _("Invalid output format '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G':
+            estimate_budget = optarg ? atol(optarg) : 1000;
+            if (estimate_budget < 1 || estimate_budget > 100000000L) {
+                error(0, 0, _("Invalid estimate budget '%s'"), optarg);
+                usage(EXIT_FAILURE);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             usage(EXIT_FAILURE);
             break;
         }
     }
-    if ((argc == 1 || optind == argc) && (help != 1)) {
+    if (plan_file && (apply_file || resume_file)) {
+        error(0, 0, _("Plan cannot be written while applying a plan or "
+                      "resuming a walk"));
+        usage(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+    if (undo_file && (plan_file || apply_file || resume_file
+                      || journal_file)) {
+        error(0, 0, _("Journal cannot be undone while writing or applying "
+                      "a plan, resuming a walk or writing a journal"));
+        usage(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+    if (incremental_file && (plan_file || apply_file || undo_file)) {
+        error(0, 0, _("Index cannot be used while writing or applying a "
+                      "plan or undoing a journal"));
+        usage(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+    if (estimate_budget && (files_from || resume_file || checkpoint_file
+                            || plan_file || apply_file || journal_file
+                            || undo_file || incremental_file)) {
+        error(0, 0, _("Estimate cannot be combined with options processing "
+                      "files"));
+        usage(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+    if (verbose && output_format == OUTPUT_NDJSON) {
+        error(0, 0, _("Output in NDJSON cannot be mixed with verbose "
+                      "messages"));
+        usage(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+    if (apply_file && shard.count > 1) {
+        error(0, 0, _("Plan cannot be applied by shards"));
+        usage(EXIT_FAILURE);
+        exit(EXIT_FAILURE);
+    }
+    if ((argc == 1 || optind == argc) && !files_from && !resume_file
+        && !apply_file && !undo_file && (help != 1)) {
         error(0, 0, _("Missing path operand"));
         usage(EXIT_FAILURE);
     } else {
+        if (stats_file)
+            stats_init();
+        governor_init(max_ops, target_latency);
+        if (prown_load_config(NULL))
+            exit(EXIT_FAILURE);
+        if (estimate_budget) {
+            /* nothing is modified, nor output by walks */
+            for (; optind < argc; optind++)
+                if (prownEstimate(argv[optind], estimate_budget))
+                    exit(EXIT_FAILURE);
+            return EXIT_SUCCESS;
+        }
+        if (checkpoint_file || resume_file) {
+            struct sigaction sa;
+
+            /* save progress before leaving on termination */
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = checkpoint_signal;
+            sa.sa_flags = SA_RESTART;
+            sigaction(SIGTERM, &sa, NULL);
+            sigaction(SIGINT, &sa, NULL);
+        }
+        if (plan_file && plan_open(plan_file))
+            exit(EXIT_FAILURE);
+        if (journal_file && journal_open(journal_file))
+            exit(EXIT_FAILURE);
+        if (incremental_file && incremental_open(incremental_file))
+            exit(EXIT_FAILURE);
+        if (output_open())
+            exit(EXIT_FAILURE);
+        if (undo_file && prownUndo(undo_file))
+            exit(EXIT_FAILURE);
+        if (apply_file && prownApply(apply_file))
+            exit(EXIT_FAILURE);
+        if (resume_file && prownResume(resume_file))
+            exit(EXIT_FAILURE);
         for (; optind < argc; optind++) {
             char *path = argv[optind];
 
-            prownProject(path);
+            if (prownProject(path))
+                exit(EXIT_FAILURE);
         }
+        if (files_from && prownFilesFrom(files_from, delim))
+            exit(EXIT_FAILURE);
+        if (journal_close() || incremental_close() || output_close())
+            exit(EXIT_FAILURE);
+        if (plan_file && plan_close())
+            exit(EXIT_FAILURE);
+        /* summary output is the end of verbose output */
+        if (output_format == OUTPUT_SUMMARY)
+            verbose = 1;
+        if (plan_file) {
+            VERBOSE(_("%zu entries scanned: %zu owners and %zu modes to "
+                      "change, %zu already compliant\n"),
+                    atomic_load(&counters.entries),
+                    atomic_load(&counters.chowned),
+                    atomic_load(&counters.chmoded),
+                    atomic_load(&counters.compliant));
+        } else if (atomic_load(&counters.entries)) {
+            VERBOSE(_("%zu entries processed: %zu owners changed, %zu modes "
+                      "changed, %zu already compliant\n"),
+                    atomic_load(&counters.entries),
+                    atomic_load(&counters.chowned),
+                    atomic_load(&counters.chmoded),
+                    atomic_load(&counters.compliant));
+        }
+        if (atomic_load(&counters.hardlinks)) {
+            VERBOSE(_("%zu hard links to entries already processed "
+                      "skipped\n"), atomic_load(&counters.hardlinks));
+        }
+        if (atomic_load(&counters.pruned)) {
+            VERBOSE(_("%zu entries pruned by exclusions or maximum depth\n"),
+                    atomic_load(&counters.pruned));
+        }
+        if (atomic_load(&counters.unchanged)) {
+            VERBOSE(_("%zu unchanged directories skipped with index\n"),
+                    atomic_load(&counters.unchanged));
+        }
+        governor_report();
     }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    int status;
+
+    owner = getuid();
+
+#ifdef PROWN_DAEMON
+    (void) status;
+    return prownd(argc, argv);
+#else
+    /* forward the request to prownd if it is running */
+    if ((status = prownd_request(argc, argv)) != -1)
+        return status;
+
+    /* Setting the i18n environment */
+    setlocale(LC_ALL, "");
+    bindtextdomain("prown", "/usr/share/locale/");
+    textdomain("prown");
+
+    return prown(argc, argv);
+#endif
 }
@@ -0,0 +1,158 @@
+/*
+ * Prown is a simple tool developed to give users the possibility to
+ * own projects (files and repositories).
+ * Copyright (C) 2021 EDF SA.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Internal interface of libprown, shared by the library and prown command.
+ * This header is not installed, applications must only use libprown.h.
+ */
+
+#ifndef PROWN_H
+#define PROWN_H
+
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <libintl.h>
+
+#define MAXLINE  1000
+#define MAXJOBS  256
+#define CONFIG_FILE "/etc/prown.conf"
+#define _(STRING) dgettext("prown", STRING)
+
+#define VERBOSE(fmt, ...) if(!verbose); else report_printf(fmt, ## __VA_ARGS__)
+#define ERROR(fmt, ...) \
+        do { if (!quiet) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+#define PERROR(msg) \
+        do { if (!quiet) perror(msg); } while (0)
+
+/*
+ * USDT probes of prown provider, available when built with sys/sdt.h. They
+ * are nops until a tracer attaches to them. Probes whose arguments are costly
+ * to build are guarded by PROBE_ENABLED(), which tests the semaphore
+ * incremented by the tracers attached to the probe. Semaphores are defined
+ * with PROBE_SEMAPHORE() in the library. Without sys/sdt.h, or if
+ * PROWN_NO_PROBES is defined, probes are removed.
+ */
+#if defined(__has_include) && !defined(PROWN_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(prown, name, ##__VA_ARGS__)
+#define PROBE_ENABLED(name) __builtin_expect(prown_##name##_semaphore, 0)
+#define PROBE_SEMAPHORE(name) \
+        unsigned short prown_##name##_semaphore \
+        __attribute__((unused, section(".probes")))
+#else
+#define PROBE(name, ...) do { } while (0)
+#define PROBE_ENABLED(name) 0
+#define PROBE_SEMAPHORE(name) struct prown_##name##_semaphore
+#endif
+
+/* format of the results of entries on standard output */
+enum output_format {
+    OUTPUT_TEXT,                /* messages in verbose mode only */
+    OUTPUT_NDJSON,              /* one JSON record per changed entry */
+    OUTPUT_SUMMARY              /* only final counters */
+};
+
+/* part of project trees processed by this process with --shard */
+struct shard {
+    int index;
+    int count;
+    int depth;                  /* split depth under project root */
+};
+
+/*
+ * Identity of the user running prown, resolved once with NSS: user name and
+ * sorted list of groups (primary and supplementary). Authorization checks are
+ * then performed in memory.
+ */
+struct identity {
+    char *name;
+    gid_t *groups;
+    int ngroups;
+};
+
+/* counters of entries processed by setOwner() */
+struct counters {
+    atomic_size_t entries;
+    atomic_size_t chowned;      /* owner changed */
+    atomic_size_t chmoded;      /* group class rw permissions added */
+    atomic_size_t compliant;    /* nothing to change */
+    atomic_size_t hardlinks;    /* links to entries already processed */
+    atomic_size_t unchanged;    /* directories skipped with index */
+    atomic_size_t pruned;       /* excluded or beyond maximum depth */
+};
+
+extern int verbose;
+extern int quiet;
+extern int recurse;
+extern int max_depth;
+extern int one_file_system;
+extern int jobs;
+extern int fd_budget;
+extern int inode_order;
+extern struct shard shard;
+extern char *checkpoint_file;
+extern int checkpoint_interval;
+extern char *stats_file;
+extern uid_t owner;
+extern struct identity *identity;
+extern struct counters counters;
+extern enum output_format output_format;
+
+void *xmalloc(size_t size);
+void *xrealloc(void *ptr, size_t size);
+int write_full(int fd, const void *buf, size_t len);
+int read_full(int fd, void *buf, size_t len);
+long long monotonic_time(void);
+void report_printf(const char *fmt, ...);
+
+void stats_init(void);
+void governor_init(long max_ops, unsigned long long target);
+void governor_report(void);
+int exclude_add(const char *pattern);
+bool exclude_match(const char *name);
+int read_config_file(const char *config_filename);
+struct identity *resolve_identity(uid_t uid);
+void free_identity(struct identity *id);
+int shard_parse(const char *spec);
+int plan_open(const char *filename);
+int plan_close(void);
+int journal_open(const char *filename);
+int journal_close(void);
+int output_open(void);
+int output_close(void);
+int incremental_open(const char *filename);
+int incremental_close(void);
+void checkpoint_signal(int signum);
+
+int prownProject(char *path);
+int prownFilesFrom(const char *filename, int delim);
+int prownResume(char *filename);
+int prownApply(const char *filename);
+int prownUndo(const char *filename);
+int prownEstimate(char *path, size_t budget);
+
+#endif
@@ -0,0 +1,358 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# Prown is a simple tool developed to give users the possibility to
+# own projects (files and repositories).
+# Copyright (C) 2021 EDF SA.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+import os
+import sys
+import argparse
+import json
+import platform
+import pwd
+import random
+import shutil
+import stat
+import subprocess
+import tempfile
+import time
+
+import launch
+
+SHAPES = ['wide', 'deep', 'small', 'mixed']
+MODES = ['serial', 'parallel', 'compliant', 'verbose', 'inode']
+
+# users from tests/defs.yml: the tree is created by the owner and prowned by
+# the runner, both members of the group owner of the project.
+TREE_OWNER = 'anna'
+RUNNER = 'mike'
+PROJECT_GROUP = 'physic'
+
+
+def log(msg):
+    print(msg, file=sys.stderr, flush=True)
+
+
+class TreeGenerator(object):
+    """Create synthetic project trees with file descriptors relative system
+    calls, so deep trees are not limited by PATH_MAX."""
+
+    def __init__(self, entries, seed):
+        self.entries = entries
+        self.created = 0
+        self.random = random.Random(seed)
+
+    def mkdir(self, dirfd, name):
+        os.mkdir(name, 0o755, dir_fd=dirfd)
+        self.created += 1
+        return os.open(name, os.O_RDONLY | os.O_DIRECTORY, dir_fd=dirfd)
+
+    def touch(self, dirfd, name, size=0):
+        fd = os.open(name, os.O_WRONLY | os.O_CREAT | os.O_EXCL, 0o644,
+                     dir_fd=dirfd)
+        if size:
+            os.write(fd, b'x' * size)
+        os.close(fd)
+        self.created += 1
+
+    def symlink(self, dirfd, target, name):
+        os.symlink(target, name, dir_fd=dirfd)
+        self.created += 1
+
+    def left(self):
+        return self.entries - self.created
+
+    def wide(self, rootfd):
+        """All entries in a single directory."""
+        for i in range(self.entries):
+            self.touch(rootfd, "f%d" % (i))
+
+    def deep(self, rootfd, depth=1000, files=3):
+        """Chains of directories, each level holding a few files."""
+        chain = 0
+        while self.left() > 0:
+            fd = self.mkdir(rootfd, "c%d" % (chain))
+            for level in range(depth):
+                if self.left() <= 0:
+                    break
+                for i in range(min(files, self.left())):
+                    self.touch(fd, "f%d" % (i))
+                if self.left() <= 0:
+                    break
+                subfd = self.mkdir(fd, "d%d" % (level))
+                os.close(fd)
+                fd = subfd
+            os.close(fd)
+            chain += 1
+
+    def small(self, rootfd, fanout=100, size=128):
+        """Balanced tree of directories holding many small files."""
+        group = 0
+        while self.left() > 0:
+            groupfd = self.mkdir(rootfd, "g%d" % (group))
+            for subdir in range(fanout):
+                if self.left() <= 0:
+                    break
+                fd = self.mkdir(groupfd, "s%d" % (subdir))
+                for i in range(min(fanout, self.left())):
+                    self.touch(fd, "f%d" % (i), size)
+                os.close(fd)
+            os.close(groupfd)
+            group += 1
+
+    def mixed(self, rootfd):
+        """Random tree with variable fanout, file sizes and symlinks."""
+        queue = [os.dup(rootfd)]
+        while queue and self.left() > 0:
+            fd = queue.pop(self.random.randrange(len(queue)))
+            for i in range(self.random.randint(0, 200)):
+                if self.left() <= 0:
+                    break
+                if self.random.random() < 0.05:
+                    self.symlink(fd, "f0", "l%d" % (i))
+                else:
+                    self.touch(fd, "f%d" % (i), self.random.choice([0, 0, 64, 512, 4096]))
+            for i in range(self.random.randint(0 if queue else 1, 8)):
+                if self.left() <= 0:
+                    break
+                queue.append(self.mkdir(fd, "d%d" % (i)))
+            os.close(fd)
+        for fd in queue:
+            os.close(fd)
+
+    def generate(self, shape, path):
+        rootfd = os.open(path, os.O_RDONLY | os.O_DIRECTORY)
+        getattr(self, shape)(rootfd)
+        os.close(rootfd)
+
+
+def as_user(user, func, *args):
+    """Run func in a child process with the identity of user, return its
+    exit status and resources usage."""
+
+    pid = os.fork()
+    if not pid:
+        status = 1
+        try:
+            pw = pwd.getpwnam(user)
+            os.setgroups(os.getgrouplist(user, pw.pw_gid))
+            os.setgid(pw.pw_gid)
+            os.setuid(pw.pw_uid)
+            status = func(*args) or 0
+        except Exception as exc:
+            log("error in %s process: %s" % (user, exc))
+        finally:
+            os._exit(status)
+    (_, status, rusage) = os.wait4(pid, 0)
+    return (os.waitstatus_to_exitcode(status), rusage)
+
+
+def generate_tree(shape, path, entries, seed):
+
+    def generate():
+        os.umask(0o022)
+        generator = TreeGenerator(entries, seed)
+        generator.generate(shape, path)
+
+    start = time.monotonic()
+    (status, _) = as_user(TREE_OWNER, generate)
+    if status:
+        raise RuntimeError("generation of %s tree failed" % (shape))
+    return time.monotonic() - start
+
+
+def reset_tree(path):
+    """Give back the tree to its owner without group write permission, as
+    just after generation."""
+    subprocess.run(['chown', '-hR', TREE_OWNER, path], check=True)
+    subprocess.run(['chmod', '-R', 'g-w', path], check=True)
+
+
+def prown_cmd(mode, jobs, path):
+    cmd = [launch.prown_path]
+    if mode == 'parallel':
+        cmd += ['--jobs', str(jobs)]
+    elif mode == 'verbose':
+        cmd += ['--verbose']
+    elif mode == 'inode':
+        cmd += ['--inode-order']
+    return cmd + [path]
+
+
+def drop_caches():
+    """Write dirty pages and drop page, dentries and inodes caches so the
+    run reads metadata from disk. Returns False if not permitted."""
+    os.sync()
+    try:
+        with open('/proc/sys/vm/drop_caches', 'w') as fh:
+            fh.write('3\n')
+    except OSError as exc:
+        log("unable to drop caches: %s" % (exc))
+        return False
+    return True
+
+
+def exec_prown(cmd):
+    fd = os.open(os.devnull, os.O_WRONLY)
+    os.dup2(fd, 1)
+    os.execve(cmd[0], cmd, {'LANG': 'C'})
+
+
+def measure(cmd, tmpdir, reset):
+    """Run prown with statistics to get its peak RSS and count system calls
+    with strace when available, or else from the operations counted in
+    statistics. Resources usage of child processes cannot be used for the
+    peak RSS as it includes the forked Python interpreter."""
+
+    stats_path = os.path.join(tmpdir, 'stats.json')
+    as_user(RUNNER, exec_prown, cmd[:1] + ['--stats=' + stats_path] + cmd[1:])
+    with open(stats_path) as fh:
+        stats = json.load(fh)
+    rss = stats['memory']['peak_rss_kb']
+    syscalls = sum([op['count'] for op in stats['ops'].values()])
+    source = 'stats'
+
+    if shutil.which('strace'):
+        if reset:
+            reset()
+        output = os.path.join(tmpdir, 'strace.txt')
+        as_user(RUNNER, exec_prown, ['/usr/bin/env', 'strace', '-f', '-c', '-q', '-o', output] + cmd)
+        with open(output) as fh:
+            for line in fh:
+                fields = line.split()
+                if fields and fields[-1] == 'total':
+                    syscalls = int(fields[3])
+                    source = 'strace'
+    return (rss, syscalls, source)
+
+
+def run_bench(shape, mode, jobs, path, entries, tmpdir, cold):
+
+    cmd = prown_cmd(mode, jobs, path)
+    reset_tree(path)
+    if mode == 'compliant':
+        # first run to get ownership, then measure the run on compliant tree
+        as_user(RUNNER, exec_prown, cmd)
+    if cold:
+        cold = drop_caches()
+
+    start = time.monotonic()
+    (status, _) = as_user(RUNNER, exec_prown, cmd)
+    elapsed = time.monotonic() - start
+
+    # measures are performed in the same conditions as timed run
+    reset = None if mode == 'compliant' else lambda: reset_tree(path)
+    if reset:
+        reset()
+    (rss, syscalls, source) = measure(cmd, tmpdir, reset)
+
+    result = {
+        'shape': shape,
+        'mode': mode,
+        'jobs': jobs if mode == 'parallel' else 1,
+        'entries': entries,
+        'exitcode': status,
+        'elapsed': round(elapsed, 6),
+        'entries_per_second': round(entries / elapsed, 1),
+        'syscalls': syscalls,
+        'syscalls_per_entry': round(syscalls / entries, 2) if syscalls else None,
+        'syscalls_source': source,
+        'peak_rss_kb': rss,
+        'cold': cold,
+    }
+    log("%-6s %-9s %10.1f entries/s %6s syscalls/entry %8d KB" %
+        (shape, mode, result['entries_per_second'],
+         result['syscalls_per_entry'], result['peak_rss_kb']))
+    return result
+
+
+def main():
+
+    parser = argparse.ArgumentParser(description='Benchmark prown traversal on synthetic trees')
+    parser.add_argument('--entries', type=int, default=1000000,
+                        help='number of entries per tree (default: %(default)s)')
+    parser.add_argument('--shapes', default=','.join(SHAPES),
+                        help='comma separated trees shapes among %s' % (', '.join(SHAPES)))
+    parser.add_argument('--modes', default=','.join(MODES),
+                        help='comma separated prown modes among %s' % (', '.join(MODES)))
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(),
+                        help='number of threads in parallel mode (default: %(default)s)')
+    parser.add_argument('--seed', type=int, default=0,
+                        help='seed of random trees (default: %(default)s)')
+    parser.add_argument('--disk', action='store_true',
+                        help='generate trees in projects directory filesystem instead of a tmpfs')
+    parser.add_argument('--drop-caches', action='store_true',
+                        help='drop kernel caches before timed runs, relevant with --disk only')
+    parser.add_argument('--output', default='/tmp/prown-bench.json',
+                        help='JSON results file, must be in /tmp to be kept (default: %(default)s)')
+    args = parser.parse_args()
+
+    shapes = args.shapes.split(',')
+    modes = args.modes.split(',')
+    for item in shapes + modes:
+        if item not in SHAPES + MODES:
+            parser.error("unknown shape or mode %s" % (item))
+
+    usersdb = launch.load_userdb()
+    launch.init_test_env(usersdb)
+
+    # trees are generated in a dedicated tmpfs, larger than the overlay upper
+    # layer, with unlimited number of inodes, unless disk filesystem is
+    # required to measure cold caches runs.
+    if not args.disk:
+        subprocess.run(['mount', '-t', 'tmpfs', '-o', 'size=90%,nr_inodes=0',
+                        'tmpfs', launch.projects_dir], check=True)
+    with open('/etc/prown.conf', 'w+') as prown_fh:
+        prown_fh.write("PROJECT_DIR %s\n" % (launch.projects_dir))
+    # devices are not available in the overlay, prown output is discarded
+    if not os.path.exists(os.devnull):
+        os.mknod(os.devnull, 0o666 | stat.S_IFCHR, os.makedev(1, 3))
+        os.chmod(os.devnull, 0o666)
+
+    # temporary directory for statistics written by prown runner
+    tmpdir = tempfile.mkdtemp()
+    os.chmod(tmpdir, 0o777)
+    results = []
+    for shape in shapes:
+        path = os.path.join(launch.projects_dir, shape)
+        os.mkdir(path)
+        shutil.chown(path, 'root', PROJECT_GROUP)
+        os.chmod(path, 0o770)
+        log("generating %s tree with %d entries" % (shape, args.entries))
+        generation = generate_tree(shape, path, args.entries, args.seed)
+        for mode in modes:
+            result = run_bench(shape, mode, args.jobs, path, args.entries,
+                               tmpdir, args.drop_caches)
+            result['generation'] = round(generation, 6)
+            results.append(result)
+        subprocess.run(['rm', '-rf', path], check=True)
+    shutil.rmtree(tmpdir)
+
+    report = {
+        'host': {
+            'kernel': platform.release(),
+            'cpus': os.cpu_count(),
+        },
+        'results': results,
+    }
+    with open(args.output, 'w+') as output_fh:
+        json.dump(report, output_fh, indent=2)
+        output_fh.write('\n')
+    log("results written in %s" % (args.output))
+
+
+if __name__ == '__main__':
+    main()
@@ -139,35 +139,48 @@ int init_namespace() {
     return 0;
 }
 
-int launch_tests() {
+int launch_script(int argc, char *argv[]) {
 
     char *env[] = { "PYTHONIOENCODING=utf-8", NULL };
     char *path;
     char *bin_path = malloc(PATH_MAX);
+    char **script_argv = malloc((argc + 3) * sizeof(char *));
+    /* Run launch.py by default, or the script given in first argument */
+    const char *script = argc > 1 ? argv[1] : "launch.py";
+    ssize_t len;
+    int i;
 
-    /* Look for launch.py in the directory of the current binary */
+    /* Look for the script in the directory of the current binary */
 
-    if (readlink("/proc/self/exe", bin_path, PATH_MAX) == -1) {
+    if ((len = readlink("/proc/self/exe", bin_path, PATH_MAX - 1)) == -1) {
         ERROR("unable to readlink(): %s\n", strerror(errno));
         return 1;
     }
+    bin_path[len] = '\0';
     path = dirname(bin_path);
 
-    strncat(path, "/launch.py", PATH_MAX);
+    strncat(path, "/", PATH_MAX - strlen(path) - 1);
+    strncat(path, script, PATH_MAX - strlen(path) - 1);
 
-    char *argv[] = { "/usr/bin/python3", path, NULL };
+    /* Following arguments are given to the script */
+    script_argv[0] = "/usr/bin/python3";
+    script_argv[1] = path;
+    for (i = 2; i < argc; i++)
+        script_argv[i] = argv[i];
+    script_argv[i] = NULL;
 
-    execve("/usr/bin/python3", argv, env);
-    return 0;
+    execve("/usr/bin/python3", script_argv, env);
+    ERROR("unable to execve(): %s\n", strerror(errno));
+    return 1;
 
 }
 
-int main() {
+int main(int argc, char *argv[]) {
 
     if (init_namespace())
         return EXIT_FAILURE;
 
-    if (launch_tests())
+    if (launch_script(argc, argv))
         return EXIT_FAILURE;
 
     return EXIT_SUCCESS;
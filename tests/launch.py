@@ -102,9 +102,10 @@ class UsersDB(object):
 
 class TestDef(object):
 
-    def __init__(self, name, prepare, tree, user, cmd, shell, exitcode, stat, stdout, stderr):
+    def __init__(self, name, prepare, cleanup, tree, user, cmd, shell, exitcode, stat, stdout, stderr):
         self.name = name
         self.prepare = prepare
+        self.cleanup = cleanup
         self.tree = tree
         self.user = user
         self.cmd = cmd
@@ -177,6 +178,7 @@ def load_tests_defs():
             for xtest in tests_y:
                 tests.append(TestDef(xtest['name'],
                                      xtest['prepare'],
+                                     xtest.get('cleanup'),
                                      xtest.get('tree', False),
                                      xtest['user'],
                                      xtest['cmd'],
@@ -284,6 +286,14 @@ def run_test(test):
     # terminate child process
     sys.exit(status)
 
+def run_script(test, script):
+
+    # run test script as root in projects directory
+    script_path = os.path.join(tmpdir, hashlib.sha224(test.name.encode('utf-8')).hexdigest() + '.sh')
+    with open(script_path, 'w+') as script_fh:
+        script_fh.write(script.replace('$BIN$', prown_path))
+    subprocess.run(['/bin/sh', script_path], cwd=projects_dir)
+
 def run_tests(tests):
 
     nb_tests = 0
@@ -296,10 +306,7 @@ def run_tests(tests):
             prown_fh.write("PROJECT_DIR %s\n" % (projects_dir))
 
         if test.prepare:
-            script_path = os.path.join(tmpdir, hashlib.sha224(test.name.encode('utf-8')).hexdigest() + '.sh')
-            with open(script_path, 'w+') as script_fh:
-                script_fh.write(test.prepare)
-            subprocess.run(['/bin/sh', script_path], cwd=projects_dir)
+            run_script(test, test.prepare)
 
         if test.tree:
             print("tree before:")
@@ -328,6 +335,9 @@ def run_tests(tests):
             print("tree after:")
             subprocess.run(['tree', '-u', '-p', '-A', '-C', '-l', '-g', projects_dir])
 
+        if test.cleanup:
+            run_script(test, test.cleanup)
+
         # remove tests data in projects directory
         for path in glob.glob(os.path.join(projects_dir, '*')):
             shutil.rmtree(path)
@@ -0,0 +1,74 @@
+/*
+ * Prown is a simple tool developed to give users the possibility to
+ * own projects (files and repositories).
+ * Copyright (C) 2021 EDF SA.
+
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Walk the paths given in arguments with libprown on behalf of the current
+ * user, printing the action of each entry given to the callback and the
+ * result of each walk.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../src/libprown.h"
+
+static const char *actions[] = {
+    [PROWN_COMPLIANT] = "compliant",
+    [PROWN_CHANGED] = "changed",
+    [PROWN_SKIPPED] = "skipped",
+    [PROWN_FAILED] = "failed",
+};
+
+static int print_entry(const struct prown_entry *entry, void *arg) {
+    size_t *count = arg;
+
+    printf("%s %s %04o\n", actions[entry->action], entry->path,
+           entry->new_mode & 07777);
+    (*count)++;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct prown_options opts;
+    struct prown_auth *auth;
+    int rc;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s PATH...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((rc = prown_load_config(NULL))) {
+        printf("%s\n", prown_strerror(rc));
+        return EXIT_FAILURE;
+    }
+    if ((auth = prown_auth_new(getuid())) == NULL) {
+        printf("Unable to resolve user\n");
+        return EXIT_FAILURE;
+    }
+    prown_options_init(&opts);
+    opts.quiet = 1;
+    for (int i = 1; i < argc; i++) {
+        size_t count = 0;
+
+        rc = prown_walk(auth, argv[i], &opts, print_entry, &count);
+        printf("%s: %s (%zu entries)\n", argv[i], prown_strerror(rc), count);
+    }
+    prown_auth_free(auth);
+    return EXIT_SUCCESS;
+}
@@ -27,7 +27,8 @@ trap cleanup EXIT
 
 echo copy into $TMPDIR
 cp -a $(dirname $0)/.. $TMPDIR/
-# set required capability on prown binary
+# set required capability on prown binary and library test program
 sudo setcap cap_chown+ep $TMPDIR/src/prown
+sudo setcap cap_chown+ep $TMPDIR/tests/libtest
 echo run isolate
-sudo $TMPDIR/tests/isolate
+sudo $TMPDIR/tests/isolate "$@"